@@ -17,7 +17,10 @@ This is a filtering approach which could be improved in time/space whether you a
 
 You compile the program with 
 
-gcc -lm -O3 ApproxIndex.c -oApproxIndex 
+gcc -O3 ApproxIndex.c -oApproxIndex -lm -pthread
+
+(add -DHAVE_ZLIB -lz and/or -DHAVE_ZSTD -lzstd to index gzip and zstd files directly,
+and -DTRACE_LEVEL=2 to trace every window and pair indexed)
 
 and then you can run it with 
 
@@ -27,12 +30,51 @@ where the sequence of Xs is the query string of 12 chars. This is a trivial inte
 
 The program returns the positions which match up to k-hamming distance with the searched string.
 
+Options -f file (file to index), -b htab|fm|sa|static (backend for the exact search of the pairs),
+-o index (save the static index), -i index (map a saved index), -S name (build the static index
+in shared memory), -A name (attach to a shared index), -H none|thp|2m|1g (huge pages) and
+-N interleave|local[:node]|replicate (NUMA placement) , -c (compact the appends into the index
+file of -i), -x from:to (retract a range of the text), -s [-t threads] [-U socket] (serve the
+queries and updates of stdin or of a unix socket), -n shards (save the index of -o in shards) and
+-C index (query the servers of the shards of index), -M budget (build the index of -o
+within a memory budget), -z (compress the text of the static index in blocks), -k mismatches
+(verify the candidates within that many mismatches), -T budget (keep the long lists of the
+index of -i on disk, with a cache of budget bytes), -R budget (cache the answers of the
+queries), -D ms (deadline of each query), -L candidates (bound of the candidates of each
+query, beyond which its answer is truncated) and -J file (dump the counters and the phase
+timers as JSON), -v level (verbosity of the traces), -E file (explain how each query
+is answered, in JSON), -P file (record a timeline of the threads as Chrome trace events)
+and -V (verify the directory and the text of a mapped index) go before the query string.
+
 */
 
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <errno.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 
 
@@ -57,10 +99,25 @@ typedef struct hnode {
 
 #define HSIZE 67867979     // Hash table size
 
-Hptr htab[HSIZE];          // Hash Table
+Hptr *htab;                // Hash Table, HSIZE heads allocated with indexAlloc()
 
 unsigned char *oldText;   // Input file to index
-int  oldTextLength=0;
+PosType oldTextLength=0;
+
+
+// Backends answering the exact search of a pair of pieces
+#define BACKEND_HTAB 0     // chained hash table of all pair-qgrams (six entries per text position)
+#define BACKEND_FM   1     // FM-index over oldText, pieces searched separately and combined by offset
+#define BACKEND_SA   2     // suffix array + LCP over oldText, pieces combined as for the FM-index
+#define BACKEND_STATIC 3   // bucketed array of all pair-qgrams, the layout of the index file
+
+#define MAXMISMATCHES 2    // four pieces: two of them are matched exactly
+
+SigType hashSeed = 5381;   // initial value of the hashing of the blocks
+
+int backend = BACKEND_HTAB;
+int indexBlockSize = 0;    // queries answered by htab and static are 4 times longer (fm and sa answer any length)
+int maxMismatches = -1;    // -k: the candidates are verified against the text, -1 returns them all
 
 
 
@@ -83,39 +140,365 @@ int int_cmp(const void *a, const void *b)
 { 
   const PosType *ia = (const PosType *)a; // casting pointer types 
   const PosType *ib = (const PosType *)b;
-  return *ia  - *ib; 
+  return (*ia > *ib) - (*ia < *ib);   // a difference would not fit an int
+}
+
+
+// microseconds of the monotonic clock
+double nowUs()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e6 + t.tv_nsec / 1e3;
+}
+
+
+// bytes given as a number with an optional suffix k, m or g: 0 if it is not one
+size_t parseSize(const char *s)
+{
+  char *unit;
+  size_t size = strtoull(s, &unit, 10);
+  if (*unit == 'k' || *unit == 'K') size <<= 10;
+  else if (*unit == 'm' || *unit == 'M') size <<= 20;
+  else if (*unit == 'g' || *unit == 'G') size <<= 30;
+  else if (*unit != 0) size = 0;
+  return size;
 }
 
 
-// Removes duplicate elements, returning the new size of modified array.
+// Removes duplicate elements (in place), returning the new size of modified array.
 int removeDuplicates(PosType *arr, int n)
 {
   if (n==0 || n==1)
     return n;
 
-  PosType temp[n];
+  // Start traversing elements, arr[0..j) holds the distinct ones
+  int j = 1;
+  for (int i=1; i<n; i++)
+    if (arr[i] != arr[j-1])
+      arr[j++] = arr[i];
 
-  // Start traversing elements
-  int j = 0;
-  for (int i=0; i<n-1; i++)
+  return j;
+}
 
-    if (arr[i] != arr[i+1])
-      temp[j++] = arr[i];
 
-  // Store the last element 
-  temp[j++] = arr[n-1];
 
-  // Modify original array
-  for (int i=0; i<j; i++)
-    arr[i] = temp[i];
 
-  return j;
+
+// ----- MEMORY PLACEMENT -----
+//
+// Large index structures (hash table, postings, text, arrays of the
+// other backends) are allocated with indexAlloc(), which applies the
+// page size and NUMA policy chosen with -H and -N and records what it
+// got, so that reportPlacement() can tell which policy was really applied.
+
+
+#define PAGES_DEFAULT 0      // plain heap, 4KB pages
+#define PAGES_THP     1      // transparent huge pages (madvise)
+#define PAGES_2MB     2      // explicit 2MB huge pages, THP if the hugetlb pool is short
+#define PAGES_1GB     3      // explicit 1GB huge pages, THP if the hugetlb pool is short
+
+#define NUMA_NONE       0    // first touch
+#define NUMA_INTERLEAVE 1    // pages spread round robin over all the nodes
+#define NUMA_LOCAL      2    // pages on numaNode, query threads pinned on its cpus
+#define NUMA_REPLICATE  3    // static index copied on every node, each query thread uses its node's copy
+
+#ifndef MPOL_BIND
+#define MPOL_BIND       2
+#define MPOL_INTERLEAVE 3
+#endif
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT  26
+#endif
+
+#define MAXNODES   64
+
+const char *pagesName[] = {"4KB", "THP", "2MB", "1GB"};
+const char *numaName[] = {"none", "interleave", "local", "replicate"};
+
+int hugePages = PAGES_DEFAULT;
+int numaPolicy = NUMA_NONE;
+int numaNode = 0;            // node of NUMA_LOCAL
+int numaNodes = 1;           // nodes of the machine
+
+typedef struct {
+  void *ptr;
+  size_t size;
+  const char *what;
+  int pages;                 // PAGES_* really obtained
+  size_t mapLength;          // bytes to munmap, 0 if on the heap
+} Region;
+
+Region *regions = NULL;      // grown as needed: an arena takes one per chunk
+int nregions = 0, regionCapacity = 0;
+pthread_mutex_t regionLock = PTHREAD_MUTEX_INITIALIZER;   // builds, reloads and reclamation run in parallel
+
+
+// number of NUMA nodes, 1 if the kernel does not tell
+int countNodes()
+{
+  int n = 0;
+  char path[64];
+  for (; n < MAXNODES; n++) {
+    sprintf(path, "/sys/devices/system/node/node%d", n);
+    if (access(path, F_OK) != 0) break;
+  }
+  return (n > 0) ? n : 1;
+}
+
+// bind [ptr,ptr+size) to node (node >= 0) or interleave it over all the nodes (node < 0)
+static int numaBind(void *ptr, size_t size, int node)
+{
+  unsigned long mask[MAXNODES / (8 * sizeof(unsigned long)) + 1];
+  memset(mask, 0, sizeof(mask));
+  if (node >= 0) mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+  else for (int k = 0; k < numaNodes; k++) mask[k / (8 * sizeof(unsigned long))] |= 1UL << (k % (8 * sizeof(unsigned long)));
+  return (int) syscall(SYS_mbind, ptr, size, (node >= 0) ? MPOL_BIND : MPOL_INTERLEAVE, mask, MAXNODES + 1, 0);
+}
+
+// apply the huge page and NUMA policies to a fresh mapping; returns the PAGES_* obtained
+// (structures that are not replicated are interleaved under NUMA_REPLICATE)
+int placeRegion(void *ptr, size_t size, int pages, int node)
+{
+  if (pages == PAGES_THP && madvise(ptr, size, MADV_HUGEPAGE) != 0) pages = PAGES_DEFAULT;
+  if (numaNodes > 1) {
+    if (node >= 0) numaBind(ptr, size, node);
+    else if (numaPolicy != NUMA_NONE) numaBind(ptr, size, -1);
+  }
+  return pages;
+}
+
+void addRegion(void *ptr, size_t size, const char *what, int pages, size_t mapLength)
+{
+  Region r = {ptr, size, what, pages, mapLength};
+  pthread_mutex_lock(&regionLock);
+  if (nregions == regionCapacity) {
+    regionCapacity = regionCapacity ? 2 * regionCapacity : 1024;
+    regions = (Region *) realloc(regions, regionCapacity * sizeof(Region));
+    assert(regions != 0, "malloc died in recording an index region");
+  }
+  regions[nregions++] = r;
+  pthread_mutex_unlock(&regionLock);
+}
+
+// mmap of size zero-filled bytes with the chosen policies, on node if node >= 0
+void *mapRegion(size_t size, int node, int *pages, size_t *length)
+{
+  void *p = MAP_FAILED;
+  *pages = hugePages;
+  *length = size;
+  if (hugePages == PAGES_2MB || hugePages == PAGES_1GB) {
+    int shift = (hugePages == PAGES_2MB) ? 21 : 30;
+    size_t hsize = (size + ((size_t) 1 << shift) - 1) & ~(((size_t) 1 << shift) - 1);
+    p = mmap(NULL, hsize, PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (shift << MAP_HUGE_SHIFT), -1, 0);
+    if (p == MAP_FAILED) *pages = PAGES_THP;     // pool empty: fall back to THP
+    else *length = hsize;
+  }
+  if (p == MAP_FAILED)
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert(p != MAP_FAILED, "mmap died in index allocation");
+  *pages = placeRegion(p, size, *pages, node);
+  return p;
+}
+
+// zero-filled memory for an index structure, described by what
+void *indexAlloc(size_t size, const char *what)
+{
+  void *p;
+  int pages = PAGES_DEFAULT;
+  size_t length = 0;
+  if (hugePages == PAGES_DEFAULT && numaPolicy == NUMA_NONE) {
+    p = calloc(1, size ? size : 1);
+    assert(p != 0, "malloc died in index allocation");
+  } else
+    p = mapRegion(size ? size : 1, (numaPolicy == NUMA_LOCAL) ? numaNode : -1, &pages, &length);
+  addRegion(p, size, what, pages, length);
+  return p;
+}
+
+// release memory of indexAlloc(), or any other region recorded with addRegion()
+void indexFree(void *p)
+{
+  if (p == NULL) return;
+  pthread_mutex_lock(&regionLock);
+  for (int i = nregions - 1; i >= 0; i--)     // the newest first, as arenas free them
+    if (regions[i].ptr == p) {
+      size_t mapLength = regions[i].mapLength;
+      regions[i] = regions[--nregions];
+      pthread_mutex_unlock(&regionLock);
+      if (mapLength > 0) munmap(p, mapLength);
+      else free(p);
+      return;
+    }
+  assert(0, "Error: freeing memory which is not an index region");
+}
+
+
+
+// ----- ARENAS -----
+//
+// Index nodes and keys are carved out of large chunks which are released
+// all together when the index is destroyed; query scratch memory comes
+// from a per-thread arena which is reset after every query.
+
+
+#define ARENA_CHUNK (64 << 20)       // chunk of the index arenas
+#define SCRATCH_CHUNK (1 << 20)      // chunk of the query scratch arenas
+#define ARENA_ALIGN 16
+
+typedef struct chunk {
+  struct chunk *next;
+  size_t size;                       // bytes of the chunk, this header included
+  size_t used;
+} Chunk;
+
+typedef struct {
+  Chunk *head;                       // chunk being filled, followed by the full ones
+  size_t chunkSize;
+  const char *what;                  // non NULL: chunks are index memory (indexAlloc)
+  void *last;                        // last allocation, it can grow in place
+} Arena;
+
+#define CHUNK_HEADER ((sizeof(Chunk) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+
+Arena nodeArena = {NULL, ARENA_CHUNK, "hash nodes", NULL};
+__thread Arena scratch = {NULL, SCRATCH_CHUNK, NULL, NULL};
+
+
+void *arenaAlloc(Arena *a, size_t size)
+{
+  size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+  if (a->head == NULL || a->head->used + size > a->head->size) {
+    size_t csize = (size + CHUNK_HEADER > a->chunkSize) ? size + CHUNK_HEADER : a->chunkSize;
+    Chunk *c = (Chunk *) (a->what ? indexAlloc(csize, a->what) : malloc(csize));
+    assert(c != 0, "malloc died in arena allocation");
+    c->size = csize;
+    c->used = CHUNK_HEADER;
+    c->next = a->head;
+    a->head = c;
+  }
+  void *p = (char *) a->head + a->head->used;
+  a->head->used += size;
+  a->last = p;
+  return p;
+}
+
+// resize the allocation p of oldSize bytes: in place if it is the last one
+void *arenaGrow(Arena *a, void *p, size_t oldSize, size_t newSize)
+{
+  size_t o = (oldSize + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+  size_t n = (newSize + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+  if (p != NULL && p == a->last && a->head->used - o + n <= a->head->size) {
+    a->head->used += n - o;
+    return p;
+  }
+  void *q = arenaAlloc(a, newSize);
+  if (p != NULL) memcpy(q, p, oldSize);
+  return q;
+}
+
+// release every chunk but one, which is emptied and kept for the next use
+void arenaReset(Arena *a)
+{
+  Chunk *keep = a->head;
+  if (keep == NULL) return;
+  for (Chunk *c = keep->next, *next; c; c = next) {
+    next = c->next;
+    if (a->what) indexFree(c); else free(c);
+  }
+  keep->next = NULL;
+  keep->used = CHUNK_HEADER;
+  a->last = NULL;
+}
+
+void arenaFree(Arena *a)
+{
+  for (Chunk *c = a->head, *next; c; c = next) {
+    next = c->next;
+    if (a->what) indexFree(c); else free(c);
+  }
+  a->head = NULL;
+  a->last = NULL;
+}
+
+// pin the calling thread on the cpus of node
+void pinToNode(int node)
+{
+  char path[80], list[4096];
+  sprintf(path, "/sys/devices/system/node/node%d/cpulist", node);
+  FILE *f = fopen(path, "r");
+  if (f == NULL) return;
+  if (fgets(list, sizeof(list), f) == NULL) list[0] = 0;
+  fclose(f);
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (char *c = list; *c && *c != '\n'; ) {   // e.g. "0-3,8-11"
+    int lo = strtol(c, &c, 10), hi = lo;
+    if (*c == '-') hi = strtol(c + 1, &c, 10);
+    for (int cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; cpu++) CPU_SET(cpu, &set);
+    if (*c == ',') c++;
+  }
+  sched_setaffinity(0, sizeof(set), &set);
+}
+
+// node of the cpu the calling thread runs on
+int currentNode()
+{
+  unsigned cpu, node;
+  if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) return 0;
+  return (int) node;
+}
+
+void reportPlacement()
+{
+  size_t total = 0;
+  fprintf(stderr, "\n memory: huge pages %s, numa %s over %d node(s)",
+	  pagesName[hugePages], numaName[numaPolicy], numaNodes);
+  if (numaPolicy == NUMA_LOCAL) fprintf(stderr, " (node %d)", numaNode);
+  fprintf(stderr, "\n");
+  for (int i = 0; i < nregions; i++) {
+    int first = 1, count = 0;       // one line for all the regions with the same name
+    size_t size = 0;
+    for (int j = 0; j < nregions; j++)
+      if (regions[j].what == regions[i].what && regions[j].pages == regions[i].pages) {
+	if (j < i) first = 0;
+	size += regions[j].size;
+	count++;
+      }
+    if (!first) continue;
+    fprintf(stderr, "   %-16s %12zu bytes  %s pages%s", regions[i].what, size,
+	    pagesName[regions[i].pages], regions[i].mapLength ? "" : " (heap)");
+    if (count > 1) fprintf(stderr, " in %d regions", count);
+    fprintf(stderr, "\n");
+    total += size;
+  }
+  fprintf(stderr, "   %-16s %12zu bytes\n", "total", total);
 }
 
 
 
+// ----- PRINTING BLOCKS AND TRACING -----
+//
+// Traces are printed by level: a level above TRACE_LEVEL (fixed at compile
+// time) is compiled out, with its prints and the loops feeding them, so the
+// build and the queries pay nothing for it; the levels compiled in are
+// printed up to the verbosity of -v.
+
+
+#define TRACE_QUERY 1          // the pairs of the query of the command line, and their candidates
+#define TRACE_BUILD 2          // the text, every window and every pair indexed (htab)
+
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL TRACE_QUERY
+#endif
+
+int verbosity = TRACE_QUERY;   // -v
+
+#define TRACING(level) ((level) <= TRACE_LEVEL && (level) <= verbosity)
+#define trace(level, ...) do { if (TRACING(level)) fprintf(stderr, __VA_ARGS__); } while (0)
 
-// ----- PRINTING BLOCKS -----
 
 void printBlock(unsigned char *text, int len)
 {
@@ -136,218 +519,5208 @@ void printBlockHex(unsigned char *text, int len)
 }
 
 
-// ----- FUNCTIONS ON HASH TABLE  -----
+// ----- INDEX VERSIONS AND SNAPSHOT READS -----
+//
+// What a query consults (the static index, its deltas and the tombstones)
+// is an immutable version. Writers, serialized by writerLock, derive a new
+// version from the current one and publish it with one atomic store, so
+// queries never wait for them. A query announces the epoch at which it
+// started in its reader slot; a replaced version is freed once no reader
+// announced an epoch older than its replacement (epoch-based reclamation).
 
 
-// returns the hashing of a block[] of size len 
-SigType hashTable(int len, unsigned char *block)
-{
-  SigType hash = 5381;
-  int c;
+#define MAXREADERS 256
 
-  for(int i=0; i < len; i++){
-    c = block[i];
-    hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+typedef struct {
+  PosType from, to;          // [from,to)
+} Range;
+
+struct staticIndex;
+struct delta;
+uint64_t staticChecksum(struct staticIndex *x);
+
+typedef struct version {
+  struct staticIndex *base;  // static index (NULL for the other backends)
+  struct delta **deltas;     // its appends, newest first
+  int ndeltas;
+  Range *tombs;              // retracted ranges: sorted, disjoint and not adjacent
+  int ntombs;
+  uint64_t epoch;            // at which it was published
+  uint64_t retired;          // epoch at which it was replaced
+  struct version *nextRetired;
+} IndexVersion;
+
+_Atomic(IndexVersion *) current = NULL;
+_Atomic uint64_t globalEpoch = 1;
+_Atomic uint64_t readerEpoch[MAXREADERS];  // 0 = the reader is not in a query
+_Atomic int slotTaken[MAXREADERS];
+_Atomic int nreaders = 0;                  // slots ever taken
+pthread_mutex_t writerLock = PTHREAD_MUTEX_INITIALIZER;
+IndexVersion *retiredVersions = NULL;      // under writerLock
+
+__thread int readerSlot = -1;
+__thread IndexVersion *snapshot = NULL;    // version seen by the running query
+
+
+// references to the static indexes and the deltas shared by versions, defined with them
+void releaseStatic(struct staticIndex *x);
+void releaseDelta(struct delta *d);
+void retainStatic(struct staticIndex *x);
+void retainDelta(struct delta *d);
+
+
+// start a read: the returned version stays valid until readEnd()
+IndexVersion *readBegin()
+{
+  if (readerSlot < 0) {      // first read of the thread: take a free slot
+    for (int i = 0; i < MAXREADERS && readerSlot < 0; i++)
+      if (atomic_exchange(&slotTaken[i], 1) == 0) readerSlot = i;
+    assert(readerSlot >= 0, "Error: too many query threads");
+    int n = atomic_load(&nreaders);
+    while (n <= readerSlot && !atomic_compare_exchange_weak(&nreaders, &n, readerSlot + 1)) ;
   }
-  return (hash % HSIZE);
+  atomic_store(&readerEpoch[readerSlot], atomic_load(&globalEpoch));
+  snapshot = atomic_load(&current);
+  return snapshot;
 }
 
-
-// returns the hashing of a block[] of size len 
-SigType hashBlock(int len, unsigned char *block)
+void readEnd()
 {
-  SigType hash;
-  int i;
+  snapshot = NULL;
+  atomic_store(&readerEpoch[readerSlot], 0);
+}
 
-  hash = 0;
-  for(i = 0; i < len; i++)
-    {
-      hash += block[i];
-      hash += (hash << 10);
-      hash ^= (hash >> 6);
-    }
-  hash += (hash << 3);
-  hash ^= (hash >> 11);
-  hash += (hash << 15);
-  return (hash % HSIZE);
+// a thread that read is ending: its slot is given back
+void readerExit()
+{
+  if (readerSlot < 0) return;
+  atomic_store(&slotTaken[readerSlot], 0);
+  readerSlot = -1;
 }
 
+// a private copy of v (the empty version if v is NULL) for a writer to modify
+IndexVersion *copyVersion(IndexVersion *v)
+{
+  IndexVersion *n = (IndexVersion *) calloc(1, sizeof(IndexVersion));
+  assert(n != 0, "malloc died in copyVersion");
+  if (v == NULL) return n;
 
+  n->base = v->base;
+  if (n->base) retainStatic(n->base);
+  n->ndeltas = v->ndeltas;
+  n->deltas = (struct delta **) malloc(sizeof(struct delta *) * (v->ndeltas + 1));
+  assert(n->deltas != 0, "malloc died in copyVersion");
+  for (int i = 0; i < v->ndeltas; i++) {
+    n->deltas[i] = v->deltas[i];
+    retainDelta(n->deltas[i]);
+  }
+  n->ntombs = v->ntombs;
+  n->tombs = (Range *) malloc(sizeof(Range) * (v->ntombs + 1));
+  assert(n->tombs != 0, "malloc died in copyVersion");
+  memcpy(n->tombs, v->tombs, sizeof(Range) * v->ntombs);
+  return n;
+}
 
-// check blocks (as hash's element) for equality: 1 = equal, 0 = different 
-int checkBlock(Hptr p, unsigned char *block, int len) {
+void freeVersion(IndexVersion *v)
+{
+  if (v->base) releaseStatic(v->base);
+  for (int i = 0; i < v->ndeltas; i++) releaseDelta(v->deltas[i]);
+  free(v->deltas);
+  free(v->tombs);
+  free(v);
+}
 
-  if (memcmp(block, p->block, len) == 0) return 1;
-  else return 0;
+// free the replaced versions no query can still be reading (under writerLock)
+void reclaimVersions()
+{
+  uint64_t oldest = UINT64_MAX;
+  int n = atomic_load(&nreaders);
+  for (int i = 0; i < n; i++) {
+    uint64_t e = atomic_load(&readerEpoch[i]);
+    if (e != 0 && e < oldest) oldest = e;
+  }
+  IndexVersion **p = &retiredVersions;
+  while (*p) {
+    if ((*p)->retired <= oldest) {
+      IndexVersion *v = *p;
+      *p = v->nextRetired;
+      freeVersion(v);
+    } else
+      p = &(*p)->nextRetired;
+  }
 }
 
+// make v the version of the next queries (under writerLock)
+void publishVersion(IndexVersion *v)
+{
+  if (v != NULL) v->epoch = atomic_load(&globalEpoch) + 1;
+  IndexVersion *old = atomic_exchange(&current, v);
+  // queries starting from now on announce an epoch >= retired and read v
+  uint64_t retired = atomic_fetch_add(&globalEpoch, 1) + 1;
+  if (old != NULL) {
+    old->retired = retired;
+    old->nextRetired = retiredVersions;
+    retiredVersions = old;
+  }
+  reclaimVersions();
+}
 
-// Insert at the head of the list a block[] of length len
-void insert(PosType i, int len, unsigned char *block, int firstPiece, int secondPiece)
-{  
-  // hash entry
-  int ht = (int) hashTable(len, block);
 
-  // stronger hash for block to store
-  SigType hb = hashBlock(len, block);
-  Hptr p = (Hptr) malloc(sizeof(Hnode));
-  assert(p != 0, "malloc died in hash insert");
 
-  p->next = htab[ht];
-  htab[ht] = p;
+// ----- TOMBSTONES -----
+//
+// Byte ranges of the text retracted without rebuilding: results starting
+// inside them are dropped while candidates are generated, and their
+// entries are not rebuilt by the next static build or compaction. The
+// ranges of a saved index are kept aside it, in "index.tombstones", with
+// the checksum of the text they retract: an index rebuilt over another text
+// does not get them.
 
-  // storing infos about the inserted block
-  p->sig = hb;
-  p->pos = i;
-  p->firstBlockPos = firstPiece;
-  p->secondBlockPos = secondPiece;
-  p->block = block;
+
+int range_cmp(const void *a, const void *b)
+{
+  PosType x = ((const Range *) a)->from, y = ((const Range *) b)->from;
+  return (x < y) ? -1 : (x > y);
 }
 
+// add [from,to) to the ranges of the private version v
+void addRange(IndexVersion *v, PosType from, PosType to)
+{
+  if (from >= to) return;
+  v->tombs = (Range *) realloc(v->tombs, sizeof(Range) * (v->ntombs + 1));
+  assert(v->tombs != 0, "malloc died in addRange");
+  v->tombs[v->ntombs].from = from;
+  v->tombs[v->ntombs++].to = to;
+  qsort(v->tombs, v->ntombs, sizeof(Range), &range_cmp);
 
-// Search block of length "len" constructed from the firstPiece+secondPiece blocks
-// it returns an array of results ended by -1 (which cannot be a position)
-PosType *search(unsigned char *block, int len, int firstPiece, int secondPiece)
+  int j = 0;
+  for (int i = 1; i < v->ntombs; i++)
+    if (v->tombs[i].from <= v->tombs[j].to) {
+      if (v->tombs[i].to > v->tombs[j].to) v->tombs[j].to = v->tombs[i].to;
+    } else
+      v->tombs[++j] = v->tombs[i];
+  v->ntombs = j + 1;
+}
+
+// retract [from,to) for the queries starting from now on
+void invalidateRange(PosType from, PosType to)
 {
-  int ht = (int) hashTable(len, block);
-  SigType hb = hashBlock(len, block);
+  pthread_mutex_lock(&writerLock);
+  IndexVersion *v = copyVersion(atomic_load(&current));
+  addRange(v, from, to);
+  publishVersion(v);
+  pthread_mutex_unlock(&writerLock);
+}
 
-  Hptr p;
+// 1 iff position pos has been invalidated in the version of the running query
+static inline int isDeleted(PosType pos)
+{
+  IndexVersion *v = snapshot;
+  if (v == NULL || v->ntombs == 0) return 0;
+  int lo = 0, hi = v->ntombs;
+  while (lo < hi) {                  // first range ending after pos
+    int mid = (lo + hi) / 2;
+    if (v->tombs[mid].to <= pos) lo = mid + 1; else hi = mid;
+  }
+  return lo < v->ntombs && v->tombs[lo].from <= pos;
+}
 
-  PosType *results = (PosType *) malloc(sizeof(PosType) * (oldTextLength+1));
-  int j=0;
+// a hash of the ranges of the version of the running query, 0 without any
+uint64_t tombstonesHash()
+{
+  IndexVersion *v = snapshot;
+  uint64_t h = 0;
+  for (int i = 0; v != NULL && i < v->ntombs; i++) {
+    h = (h ^ (uint64_t) v->tombs[i].from) * 1099511628211ULL;
+    h = (h ^ (uint64_t) v->tombs[i].to) * 1099511628211ULL;
+  }
+  return h;
+}
 
-  for (p = htab[ht]; p; p = p->next)
-    if ((p->sig == hb) && (checkBlock(p,block,len)) 
-	&& (p->firstBlockPos == firstPiece) 
-	&& (p->secondBlockPos == secondPiece)) { 
-      results[j++] = p->pos; 
+// number of invalidated positions in [from,to), as isDeleted() sees them
+PosType deletedIn(PosType from, PosType to)
+{
+  IndexVersion *v = snapshot;
+  PosType n = 0;
+  for (int i = 0; v != NULL && i < v->ntombs; i++) {
+    PosType a = (v->tombs[i].from > from) ? v->tombs[i].from : from;
+    PosType b = (v->tombs[i].to < to) ? v->tombs[i].to : to;
+    if (a < b) n += b - a;
+  }
+  return n;
+}
+
+// forget the positions below limit in the private version v: their entries are gone
+void dropTombstonesBelow(IndexVersion *v, PosType limit)
+{
+  int j = 0;
+  for (int i = 0; i < v->ntombs; i++)
+    if (v->tombs[i].to > limit) {
+      v->tombs[j] = v->tombs[i];
+      if (v->tombs[j].from < limit) v->tombs[j].from = limit;
+      j++;
     }
+  v->ntombs = j;
+}
 
-  results[j]=-1;
-  return results; //list of results
+// add the ranges saved aside indexName to the private version v, if they
+// retract the text of its static index
+void loadTombstones(IndexVersion *v, const char *indexName)
+{
+  char name[4096];
+  long from, to;
+  unsigned long long checksum;
+  snprintf(name, sizeof(name), "%s.tombstones", indexName);
+  FILE *f = fopen(name, "r");
+  if (f == NULL) return;
+  if (fscanf(f, "AI2HAMTS %llx", &checksum) != 1 || checksum != staticChecksum(v->base))
+    fprintf(stderr, "  %s: tombstones of another text, ignored\n", name);
+  else
+    while (fscanf(f, "%ld %ld", &from, &to) == 2)
+      addRange(v, from, to);
+  fclose(f);
 }
 
+void saveTombstones(IndexVersion *v, const char *indexName)
+{
+  char name[4096];
+  snprintf(name, sizeof(name), "%s.tombstones", indexName);
+  if (v->ntombs == 0) { unlink(name); return; }
+  FILE *f = fopen(name, "w");
+  assert(f != NULL, "Error: Unable to write the tombstones");
+  fprintf(f, "AI2HAMTS %llx\n", (unsigned long long) staticChecksum(v->base));
+  for (int i = 0; i < v->ntombs; i++)
+    fprintf(f, "%ld %ld\n", (long) v->tombs[i].from, (long) v->tombs[i].to);
+  fclose(f);
+}
 
 
-// ----- MAIN PROCEDURE -----
 
-int main(int argc, char *argv[])
+// ----- QUERY BUDGETS -----
+//
+// A query can be bounded by a deadline (-D, milliseconds from its
+// submission) and by a number of candidates (-L): the searches of its pairs
+// and the verification of -k count the entries they go through, and look
+// at the clock and at the cancellation of the query (its connection was
+// closed) every BUDGET_CHECK of them. Once a bound is passed they stop,
+// and the query answers the positions found so far, flagged as truncated.
+// Truncated answers are not cached. The budget of the query being answered
+// is the one of its thread, so the backends need no extra argument.
+
+
+#define BUDGET_CHECK 1024     // entries gone through between two looks at the clock
+
+typedef struct {
+  double deadline;           // nowUs() at which the query stops, 0 for none
+  long candidates;           // left to find, -1 for no bound
+  _Atomic int *cancelled;    // if not NULL, the query stops once it is set
+  int ticks;                 // entries since the last look at the clock
+  int truncated;             // the query was stopped
+} Budget;
+
+double deadlineMs = 0;       // -D: 0 for no deadline
+long maxCandidates = -1;     // -L: -1 for no bound
+__thread Budget *queryBudget = NULL;   // of the query the thread is answering, if bounded
+
+// the query of b has a bound: its searches go through the budget
+static inline int budgetBounded(Budget *b)
 {
-  FILE *old_file;    
-  const char *oldFileName = "old_file.dat";
-  
+  return b->deadline > 0 || b->candidates >= 0 || b->cancelled != NULL;
+}
 
-  // ARGV[1] = string to be searched (assume ended by \0)
-  unsigned char *queryStr = (unsigned char *) malloc(100); // assume max 100 bytes for the query
-  for(int i=0; i<50; i++)
-    queryStr[i]=0;
-  for(int i=0; i<strlen(argv[1]); i++)
-    queryStr[i]=argv[1][i];
-  
-  int queryLen = strlen(argv[1]);
-  if (queryLen % 4 != 0){
-    printf("Error, query length should be a multiple of 4\n\n");
-    exit(1);
-  }
+// the budget of -D and -L of a query submitted at time submitted (nowUs())
+void budgetInit(Budget *b, double submitted, _Atomic int *cancelled)
+{
+  b->deadline = (deadlineMs > 0) ? submitted + deadlineMs * 1000 : 0;
+  b->candidates = maxCandidates;
+  b->cancelled = cancelled;
+  b->ticks = 0;
+  b->truncated = 0;
+}
 
+// look at the clock and at the cancellation: 1 if the query must stop
+int budgetCheck(Budget *b)
+{
+  b->ticks = 0;
+  if ((b->deadline > 0 && nowUs() > b->deadline) || (b->cancelled != NULL && atomic_load(b->cancelled)))
+    b->truncated = 1;
+  return b->truncated;
+}
 
-  int blockSize = queryLen/4;  //We split the queryString in 4 blocks of equal length
+// an entry gone through by the query of the thread: 1 if it must stop
+static inline int budgetTick()
+{
+  Budget *b = queryBudget;
+  if (b == NULL) return 0;
+  if (b->truncated) return 1;
+  return (++b->ticks == BUDGET_CHECK) && budgetCheck(b);
+}
 
-  // fetch the old file in oldText 
-  fprintf(stderr,"  fetching file...");
-  old_file = fopen(oldFileName, "r");
-  if (old_file == NULL) {
-    fprintf(stderr,"\n\nError: Unable to open %s\n",oldFileName);
-    exit (8);  }
-  fseek(old_file, 0, SEEK_END);
+// a candidate found by the query of the thread: 1 if it must stop instead (-L is reached)
+static inline int budgetTake()
+{
+  Budget *b = queryBudget;
+  if (b == NULL || b->candidates < 0) return 0;
+  if (b->candidates == 0) return b->truncated = 1;
+  b->candidates--;
+  return 0;
+}
 
-  oldTextLength = (PosType) ftell(old_file);
-  fseek(old_file, 0, SEEK_SET);
+// the positions r (ended by -1) taken by the query of the thread, as far as -L allows
+static void budgetClamp(PosType *r)
+{
+  for (int j = 0; r[j] != -1; j++)
+    if (budgetTake()) {
+      r[j] = -1;
+      break;
+    }
+}
 
-  oldText = (unsigned char *) malloc(oldTextLength+1);
-  fread(oldText, 1, oldTextLength, old_file);
-  fclose(old_file);
-  oldText[oldTextLength] = 0; // ended by \0
 
-  fprintf(stderr,"\n%s\n\n",oldText);
-  fprintf(stderr,"... fetched!!\n");
 
+// ----- PERFORMANCE COUNTERS -----
+//
+// Counters and phase timers, always on: a counter is a relaxed atomic
+// addition made once per pair searched or per query, never per entry, and
+// a phase is timed by two readings of the monotonic clock. They are dumped
+// as JSON at the end (-J file) and by the command "!stats", together with
+// the shape of the index served: its entries and the histogram of the
+// lengths of its chains (the lists of its buckets).
 
-  // Construct the dictionary of blocks of size 2 * blockSize
-  fprintf(stderr,"Building hash table...");
-    
-  int qgramSize = 2 * blockSize;
-  for (int i = 0; i < oldTextLength-queryLen+1; i++) {
 
-    fprintf(stderr,"\n\n %d - check:",i);
-    printBlock(oldText+i,queryLen);
-    fprintf(stderr, "\n");
-	
-    // Take a qgram as 2 blocks, each of size blockSize characters
-    for(int first=0; first < 3; first++){
-      for(int second = first+1; second <= 3; second++){
-	
-	unsigned char *blockTmp = (unsigned char *) malloc (qgramSize+1);  //allocate memory for the block
-	blockTmp[qgramSize] = 0;
-	for(int l=0; l < blockSize; l++){
-	  blockTmp[l] = oldText[i + first * blockSize + l];
-	  blockTmp[l+blockSize] = oldText[i + second * blockSize + l];
-	}
-	
-	printBlock(blockTmp,qgramSize);
-	fprintf(stderr, "\n");
-	insert(i, qgramSize, blockTmp, first, second);
-      } // end second
-    } // end first
+#define STAT_BINS 32           // histograms by powers of 2: 0, 1, 2-3, 4-7, ...
 
-    if (i % 1000000 == 0) fprintf(stderr, ".");
+#define PHASE_LOAD   0         // reading the text, or mapping the index
+#define PHASE_BUILD  1
+#define PHASE_LOOKUP 2         // exact searches of the pairs
+#define PHASE_VERIFY 3         // -k
+#define PHASE_OUTPUT 4         // writing the answers
+#define NPHASES      5
 
-  }
+const char *phaseName[NPHASES] = {"load", "build", "lookup", "verify", "output"};
 
+typedef struct {
+  _Atomic uint64_t positions;          // windows of the text indexed (appends and compactions too)
+  _Atomic uint64_t entries;            // pair-qgram entries built
+  _Atomic uint64_t queries;            // asked, those answered by the cache of -R too
+  _Atomic uint64_t pairs;              // searched
+  _Atomic uint64_t candidates;         // found by the pairs
+  _Atomic uint64_t duplicates;         // candidates found by another pair of the query too
+  _Atomic uint64_t verified;           // candidates compared with the text (-k)
+  _Atomic uint64_t rejected;           // of them, farther than -k from the query
+  _Atomic uint64_t truncated;          // queries stopped by -D, -L or their cancellation
+  _Atomic uint64_t pairCandidates[STAT_BINS];   // pairs searched, by their candidates
+  _Atomic uint64_t phaseNs[NPHASES];
+  _Atomic uint64_t phaseCount[NPHASES];
+} Stats;
 
+Stats stats;
+const char *statsFile = NULL;  // -J: where the JSON goes, "-" for stderr
 
-  // ************ QUERY
-  fprintf(stderr,"\n\n ***** QUERY *****\n\n");
-  PosType *r = (PosType *)malloc((oldTextLength+1) * sizeof(PosType));
-  int rSize = 0;
-  PosType *r_tmp;
+static inline void statAdd(_Atomic uint64_t *counter, uint64_t n)
+{
+  atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
 
-  for(int first=0; first < 3; first++){
-    for(int second = first+1; second <= 3; second++){
-      
-      //allocate memory and create the block to be searched exactly
-      unsigned char *blockTmp = (unsigned char *) malloc (qgramSize+1);  
+// the bin of n in a histogram
+static inline int statBin(uint64_t n)
+{
+  int b = (n == 0) ? 0 : 64 - __builtin_clzll(n);
+  return (b < STAT_BINS) ? b : STAT_BINS - 1;
+}
+
+// a phase started when nowUs() was start is over
+static inline void statPhase(int phase, double start)
+{
+  statAdd(&stats.phaseNs[phase], (uint64_t) ((nowUs() - start) * 1000));
+  statAdd(&stats.phaseCount[phase], 1);
+}
+
+
+
+// ----- TIMELINE -----
+//
+// With -P file each thread records spans of what it does (reading, hashing
+// and inserting of the build, runs and merge of -M, batches of queries with
+// their lookups, merges and verifications, compactions and reloads) in a
+// buffer of its own, and at the end all of them are written as a Chrome
+// trace-event file (chrome://tracing or Perfetto), one track per thread:
+// stalls, load imbalance and bubbles of the pipelines show up there.
+// Without -P a span costs a test of a global.
+
+
+#define TIMELINE_MAX (1 << 20)      // spans kept per thread, the next ones are dropped
+#define TIMELINE_WINDOWS (1 << 16)  // windows of the htab build hashed per span
+
+typedef struct {
+  const char *name;
+  double start, us;
+} Span;
+
+typedef struct timeline {
+  int tid;
+  const char *name;          // of the thread
+  Span *spans;
+  int n, capacity;
+  uint64_t dropped;
+  struct timeline *next;
+} Timeline;
+
+const char *timelineFile = NULL;   // -P
+pthread_mutex_t timelineLock = PTHREAD_MUTEX_INITIALIZER;
+Timeline *timelines = NULL;         // of the threads that recorded spans, newest first
+int timelineThreads = 0;
+double timelineOrigin;              // nowUs() at the start
+__thread Timeline *threadTimeline = NULL;
+
+// the timeline of the thread, made at its first span
+static Timeline *myTimeline()
+{
+  if (threadTimeline == NULL) {
+    Timeline *t = (Timeline *) calloc(1, sizeof(Timeline));
+    assert(t != 0, "malloc died in recording the timeline");
+    pthread_mutex_lock(&timelineLock);
+    t->tid = ++timelineThreads;
+    t->next = timelines;
+    timelines = t;
+    pthread_mutex_unlock(&timelineLock);
+    threadTimeline = t;
+  }
+  return threadTimeline;
+}
+
+// the name of the track of the thread (a constant string)
+void timelineName(const char *name)
+{
+  if (timelineFile != NULL) myTimeline()->name = name;
+}
+
+// the start of a span, for spanEnd()
+static inline double spanBegin()
+{
+  return (timelineFile != NULL) ? nowUs() : 0;
+}
+
+// the span name (a constant string), begun at start, is over
+void spanEnd(const char *name, double start)
+{
+  if (timelineFile == NULL) return;
+  Timeline *t = myTimeline();
+  if (t->n == t->capacity) {
+    if (t->capacity == TIMELINE_MAX) {
+      t->dropped++;
+      return;
+    }
+    t->capacity = t->capacity ? 2 * t->capacity : 1024;
+    t->spans = (Span *) realloc(t->spans, sizeof(Span) * t->capacity);
+    assert(t->spans != 0, "malloc died in recording the timeline");
+  }
+  Span *sp = &t->spans[t->n++];
+  sp->name = name;
+  sp->start = start;
+  sp->us = nowUs() - start;
+}
+
+// write the spans of all the threads as trace events, then free them
+// (the threads still running must not record any more)
+void timelineWrite()
+{
+  FILE *f = fopen(timelineFile, "w");
+  if (f == NULL) {
+    fprintf(stderr, "  unable to write the timeline in %s\n", timelineFile);
+    return;
+  }
+  int pid = (int) getpid();
+  uint64_t spans = 0, dropped = 0;
+  fprintf(f, "{\"traceEvents\": [");
+  for (Timeline *t = timelines, *next; t != NULL; t = next) {
+    next = t->next;
+    fprintf(f, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+	    (t == timelines) ? "" : ",", pid, t->tid, t->name ? t->name : "thread");
+    for (int i = 0; i < t->n; i++)
+      fprintf(f, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+	      t->spans[i].name, pid, t->tid, t->spans[i].start - timelineOrigin, t->spans[i].us);
+    spans += t->n;
+    dropped += t->dropped;
+    free(t->spans);
+    free(t);
+  }
+  fprintf(f, "\n], \"displayTimeUnit\": \"ms\"}\n");
+  fclose(f);
+  timelines = NULL;
+  threadTimeline = NULL;
+  fprintf(stderr, "\n timeline: %llu spans of %d threads in %s", (unsigned long long) spans, timelineThreads, timelineFile);
+  if (dropped > 0) fprintf(stderr, " (%llu dropped)", (unsigned long long) dropped);
+  fprintf(stderr, "\n");
+}
+
+
+
+// ----- FUNCTIONS ON HASH TABLE  -----
+
+
+// returns the hashing of a block[] of size len, not reduced to a table size
+SigType hashKey(int len, unsigned char *block)
+{
+  SigType hash = hashSeed;
+  int c;
+
+  for(int i=0; i < len; i++){
+    c = block[i];
+    hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+  }
+  return hash;
+}
+
+// returns the hashing of a block[] of size len 
+SigType hashTable(int len, unsigned char *block)
+{
+  return (hashKey(len, block) % HSIZE);
+}
+
+
+// returns the hashing of a block[] of size len 
+SigType hashBlock(int len, unsigned char *block)
+{
+  SigType hash;
+  int i;
+
+  hash = 0;
+  for(i = 0; i < len; i++)
+    {
+      hash += block[i];
+      hash += (hash << 10);
+      hash ^= (hash >> 6);
+    }
+  hash += (hash << 3);
+  hash ^= (hash >> 11);
+  hash += (hash << 15);
+  return (hash % HSIZE);
+}
+
+
+
+// check blocks (as hash's element) for equality: 1 = equal, 0 = different 
+int checkBlock(Hptr p, unsigned char *block, int len) {
+
+  if (memcmp(block, p->block, len) == 0) return 1;
+  else return 0;
+}
+
+
+// Node of a block[] of length len, to be inserted in the list htab[*ht]
+Hptr newNode(PosType i, int len, unsigned char *block, int firstPiece, int secondPiece, int *ht)
+{  
+  // hash entry
+  *ht = (int) hashTable(len, block);
+
+  // stronger hash for block to store
+  SigType hb = hashBlock(len, block);
+  Hptr p = (Hptr) arenaAlloc(&nodeArena, sizeof(Hnode));
+
+  // storing infos about the inserted block
+  p->sig = hb;
+  p->pos = i;
+  p->firstBlockPos = firstPiece;
+  p->secondBlockPos = secondPiece;
+  p->block = block;
+  return p;
+}
+
+// Insert p at the head of the list htab[ht]
+void linkNode(Hptr p, int ht)
+{
+  p->next = htab[ht];
+  htab[ht] = p;
+}
+
+
+// Search block of length "len" constructed from the firstPiece+secondPiece blocks
+// it returns an array of results ended by -1 (which cannot be a position)
+PosType *search(unsigned char *block, int len, int firstPiece, int secondPiece)
+{
+  int ht = (int) hashTable(len, block);
+  SigType hb = hashBlock(len, block);
+
+  Hptr p;
+
+  int capacity = 64;
+  PosType *results = (PosType *) arenaAlloc(&scratch, sizeof(PosType) * capacity);
+  int j=0;
+
+  for (p = htab[ht]; p && !budgetTick(); p = p->next)
+    if ((p->sig == hb) && (checkBlock(p,block,len)) 
+	&& (p->firstBlockPos == firstPiece) 
+	&& (p->secondBlockPos == secondPiece)
+	&& !isDeleted(p->pos)) { 
+      if (budgetTake()) break;
+      if (j+1 == capacity) {
+	results = (PosType *) arenaGrow(&scratch, results, sizeof(PosType) * capacity, sizeof(PosType) * 2 * capacity);
+	capacity *= 2;
+      }
+      results[j++] = p->pos; 
+    }
+
+  results[j]=-1;
+  return results; //list of results
+}
+
+
+// release the nodes, their keys and the table all together
+void destroyHtab()
+{
+  arenaFree(&nodeArena);
+  indexFree(htab);
+  htab = NULL;
+}
+
+
+
+// ----- COMPRESSED INPUT FILES -----
+//
+// The text to index may be given compressed: gzip files (compiled with
+// -DHAVE_ZLIB, linking -lz) and zstd files (-DHAVE_ZSTD, -lzstd) are
+// recognized by their magic bytes and decoded while they are read, with no
+// decompressed copy on disk. The length of the text is needed before it is
+// read: zstd records it in the header of its frames (usually), gzip only
+// modulo 2^32 and per member, so when it is not recorded the file is
+// decoded once more beforehand just to count it. A zstd file of many
+// frames whose sizes are all recorded is decoded by a thread per cpu, each
+// frame directly at its place in the text.
+
+
+#define FORMAT_PLAIN 0
+#define FORMAT_GZIP  1
+#define FORMAT_ZSTD  2
+
+#define SOURCE_BUFFER (1 << 20)    // compressed bytes read at a time
+
+typedef struct {
+  int format;
+  FILE *f;
+  PosType length;            // bytes of text
+  int end;                   // compressed: the stream is over
+  const char *error;         // why the text ended early (corrupted or truncated), NULL if it did not
+  unsigned char *in;         // gzip: input buffer
+  unsigned char *data;       // zstd: the file, mapped
+  size_t size;
+  int nframes;               // zstd: frames whose size is recorded, 0 if some is not
+  size_t *frameStart;        // zstd: offset of each frame in the file
+  PosType *frameOffset;      // zstd: offset of its content in the text (nframes+1 entries)
+#ifdef HAVE_ZLIB
+  z_stream z;
+#endif
+#ifdef HAVE_ZSTD
+  ZSTD_DStream *zs;
+  ZSTD_inBuffer zin;
+  size_t zpending;           // zstd: 0 iff the last frame decoded is complete
+#endif
+} Source;
+
+
+// read the next n bytes of text (less only at its end, or if s->error is set),
+// returns how many were read
+size_t sourceRead(Source *s, unsigned char *buf, size_t n)
+{
+  if (s->format == FORMAT_PLAIN) return fread(buf, 1, n, s->f);
+#ifdef HAVE_ZLIB
+  if (s->format == FORMAT_GZIP) {
+    s->z.next_out = buf;
+    s->z.avail_out = n;
+    while (s->z.avail_out > 0 && !s->end) {
+      if (s->z.avail_in == 0) {
+	s->z.next_in = s->in;
+	s->z.avail_in = fread(s->in, 1, SOURCE_BUFFER, s->f);
+	if (s->z.avail_in == 0) { s->end = 1; s->error = "Error: truncated gzip file"; break; }
+      }
+      int ret = inflate(&s->z, Z_NO_FLUSH);
+      if (ret == Z_STREAM_END) {
+	// another member may follow (files concatenated, bgzip)
+	if (s->z.avail_in == 0) {
+	  s->z.next_in = s->in;
+	  s->z.avail_in = fread(s->in, 1, SOURCE_BUFFER, s->f);
+	}
+	if (s->z.avail_in == 0) s->end = 1;
+	else inflateReset(&s->z);
+      } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+	s->end = 1;
+	s->error = "Error: corrupted gzip file";
+      }
+    }
+    return n - s->z.avail_out;
+  }
+#endif
+#ifdef HAVE_ZSTD
+  if (s->format == FORMAT_ZSTD) {
+    ZSTD_outBuffer out = {buf, n, 0};
+    while (out.pos < out.size && (s->zin.pos < s->zin.size || s->zpending) && s->error == NULL) {
+      size_t pos = out.pos;
+      s->zpending = ZSTD_decompressStream(s->zs, &out, &s->zin);
+      if (ZSTD_isError(s->zpending)) s->error = "Error: corrupted zstd file";
+      else if (s->zpending && s->zin.pos == s->zin.size && out.pos == pos) s->error = "Error: truncated zstd file";
+    }
+    return out.pos;
+  }
+#endif
+  return 0;
+}
+
+// back to the start of the text
+void sourceRewind(Source *s)
+{
+  fseeko(s->f, 0, SEEK_SET);
+  s->end = 0;
+#ifdef HAVE_ZLIB
+  if (s->format == FORMAT_GZIP) {
+    inflateReset(&s->z);
+    s->z.avail_in = 0;
+  }
+#endif
+#ifdef HAVE_ZSTD
+  if (s->format == FORMAT_ZSTD) {
+    ZSTD_initDStream(s->zs);
+    s->zin.pos = 0;
+    s->zpending = 0;
+  }
+#endif
+}
+
+// skip the next n bytes of text: 0 if it ends before
+int sourceSkip(Source *s, PosType n)
+{
+  if (s->format == FORMAT_PLAIN) return fseeko(s->f, n, SEEK_CUR) == 0;
+  unsigned char *buf = (unsigned char *) malloc(SOURCE_BUFFER);
+  assert(buf != 0, "malloc died in sourceSkip");
+  size_t m = 1;
+  while (n > 0 && m > 0) {
+    m = sourceRead(s, buf, (n < SOURCE_BUFFER) ? n : SOURCE_BUFFER);
+    n -= m;
+  }
+  free(buf);
+  return n == 0;
+}
+
+void sourceClose(Source *s);
+
+// 0 if the file cannot be opened, is compressed by a codec not compiled in
+// or is corrupted: the reason is printed
+int sourceOpen(Source *s, const char *fileName)
+{
+  memset(s, 0, sizeof(*s));
+  s->f = fopen(fileName, "r");
+  if (s->f == NULL) return 0;
+  unsigned char magic[4] = {0, 0, 0, 0};
+  size_t m = fread(magic, 1, 4, s->f);
+  fseeko(s->f, 0, SEEK_END);
+  s->size = ftello(s->f);
+  fseeko(s->f, 0, SEEK_SET);
+  s->length = s->size;
+
+  if (m >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+#ifdef HAVE_ZLIB
+    s->format = FORMAT_GZIP;
+    s->in = (unsigned char *) malloc(SOURCE_BUFFER);
+    assert(s->in != 0 && inflateInit2(&s->z, 15 + 32) == Z_OK, "Error: unable to decode gzip");
+    s->length = -1;
+#else
+    fprintf(stderr, "\n\nError: %s is a gzip file, compile with -DHAVE_ZLIB -lz to index it\n", fileName);
+    fclose(s->f);
+    return 0;
+#endif
+  } else if (m == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) {
+#ifdef HAVE_ZSTD
+    s->format = FORMAT_ZSTD;
+    s->data = (unsigned char *) mmap(NULL, s->size, PROT_READ, MAP_SHARED, fileno(s->f), 0);
+    if (s->data == MAP_FAILED) {
+      fprintf(stderr, "\n\nError: mmap of the zstd file %s failed\n", fileName);
+      fclose(s->f);
+      return 0;
+    }
+    s->zs = ZSTD_createDStream();
+    ZSTD_initDStream(s->zs);
+    s->zin.src = s->data;
+    s->zin.size = s->size;
+    s->zin.pos = 0;
+
+    // the frames and their sizes, if all recorded
+    s->length = 0;
+    int cap = 16;
+    s->frameStart = (size_t *) malloc(cap * sizeof(size_t));
+    s->frameOffset = (PosType *) malloc((cap + 1) * sizeof(PosType));
+    for (size_t p = 0; p < s->size && s->length >= 0; ) {
+      unsigned long long c = ZSTD_getFrameContentSize(s->data + p, s->size - p);
+      size_t fsize = ZSTD_findFrameCompressedSize(s->data + p, s->size - p);
+      if (ZSTD_isError(fsize)) { s->length = -1; s->error = "Error: corrupted zstd file"; break; }
+      if (c == ZSTD_CONTENTSIZE_UNKNOWN || c == ZSTD_CONTENTSIZE_ERROR) { s->length = -1; break; }
+      if (s->nframes == cap) {
+	cap *= 2;
+	s->frameStart = (size_t *) realloc(s->frameStart, cap * sizeof(size_t));
+	s->frameOffset = (PosType *) realloc(s->frameOffset, (cap + 1) * sizeof(PosType));
+      }
+      s->frameStart[s->nframes] = p;
+      s->frameOffset[s->nframes++] = s->length;
+      s->length += c;
+      p += fsize;
+    }
+    if (s->length < 0) s->nframes = 0;
+    else s->frameOffset[s->nframes] = s->length;
+    if (s->error != NULL) {
+      fprintf(stderr, "\n\n%s %s\n", s->error, fileName);
+      sourceClose(s);
+      return 0;
+    }
+#else
+    fprintf(stderr, "\n\nError: %s is a zstd file, compile with -DHAVE_ZSTD -lzstd to index it\n", fileName);
+    fclose(s->f);
+    return 0;
+#endif
+  }
+
+  if (s->length < 0) {       // size not recorded: decode it all to count it
+    unsigned char *buf = (unsigned char *) malloc(SOURCE_BUFFER);
+    assert(buf != 0, "malloc died in sourceOpen");
+    size_t n;
+    s->length = 0;
+    while ((n = sourceRead(s, buf, SOURCE_BUFFER)) > 0) s->length += n;
+    free(buf);
+    if (s->error != NULL) {
+      fprintf(stderr, "\n\n%s %s\n", s->error, fileName);
+      sourceClose(s);
+      return 0;
+    }
+    sourceRewind(s);
+  }
+  return 1;
+}
+
+void sourceClose(Source *s)
+{
+#ifdef HAVE_ZLIB
+  if (s->format == FORMAT_GZIP) inflateEnd(&s->z);
+#endif
+#ifdef HAVE_ZSTD
+  if (s->format == FORMAT_ZSTD) {
+    ZSTD_freeDStream(s->zs);
+    munmap(s->data, s->size);
+  }
+#endif
+  free(s->in);
+  free(s->frameStart);
+  free(s->frameOffset);
+  fclose(s->f);
+  s->f = NULL;
+}
+
+
+
+// ----- BOUNDED QUEUES AND PIPELINED BUILD -----
+//
+// The hash table is built by a pipeline: a reader thread fills oldText
+// with large sequential reads (decoding it if compressed), the hashing stage (the building thread)
+// forms the pair-qgrams of the windows whose bytes have arrived, and
+// inserter threads link them in the buckets of their partition of the
+// table (ht % nparts). Nodes travel in batches through bounded
+// queues, a stage running ahead waits for the next one, so reading,
+// hashing and insertion overlap. Each bucket gets its nodes in text
+// order, as with the sequential build.
+
+
+typedef struct {
+  void **items;
+  int size, head, count, closed;
+  pthread_mutex_t lock;
+  pthread_cond_t notEmpty, notFull;
+} Queue;
+
+void queueInit(Queue *q, int size)
+{
+  q->items = (void **) malloc(size * sizeof(void *));
+  assert(q->items != 0, "malloc died in queueInit");
+  q->size = size;
+  q->head = q->count = q->closed = 0;
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->notEmpty, NULL);
+  pthread_cond_init(&q->notFull, NULL);
+}
+
+void queueDestroy(Queue *q)
+{
+  free(q->items);
+  pthread_mutex_destroy(&q->lock);
+  pthread_cond_destroy(&q->notEmpty);
+  pthread_cond_destroy(&q->notFull);
+}
+
+// append item if the queue is not full: 1 if it was appended
+int queueTryPut(Queue *q, void *item)
+{
+  pthread_mutex_lock(&q->lock);
+  int room = (q->count < q->size);
+  if (room) {
+    q->items[(q->head + q->count++) % q->size] = item;
+    pthread_cond_signal(&q->notEmpty);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return room;
+}
+
+// append item, waiting while the queue is full
+void queuePut(Queue *q, void *item)
+{
+  pthread_mutex_lock(&q->lock);
+  while (q->count == q->size) pthread_cond_wait(&q->notFull, &q->lock);
+  q->items[(q->head + q->count++) % q->size] = item;
+  pthread_cond_signal(&q->notEmpty);
+  pthread_mutex_unlock(&q->lock);
+}
+
+// next item, NULL once the queue is closed and empty
+void *queueGet(Queue *q)
+{
+  pthread_mutex_lock(&q->lock);
+  while (q->count == 0 && !q->closed) pthread_cond_wait(&q->notEmpty, &q->lock);
+  void *item = NULL;
+  if (q->count > 0) {
+    item = q->items[q->head];
+    q->head = (q->head + 1) % q->size;
+    q->count--;
+    pthread_cond_signal(&q->notFull);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return item;
+}
+
+// the next items, at most max: waits for one, then takes those already there;
+// 0 once the queue is closed and empty
+int queueGetBatch(Queue *q, void **items, int max)
+{
+  pthread_mutex_lock(&q->lock);
+  while (q->count == 0 && !q->closed) pthread_cond_wait(&q->notEmpty, &q->lock);
+  int n = 0;
+  for (; n < max && q->count > 0; n++) {
+    items[n] = q->items[q->head];
+    q->head = (q->head + 1) % q->size;
+    q->count--;
+  }
+  if (n > 0) pthread_cond_broadcast(&q->notFull);
+  pthread_mutex_unlock(&q->lock);
+  return n;
+}
+
+void queueClose(Queue *q)
+{
+  pthread_mutex_lock(&q->lock);
+  q->closed = 1;
+  pthread_cond_broadcast(&q->notEmpty);
+  pthread_mutex_unlock(&q->lock);
+}
+
+
+#define READ_CHUNK (8 << 20)  // bytes per read of the text
+#define NPARTS     4          // inserter threads at most, one less than the cpus
+#define BATCH      4096       // nodes per batch
+#define PIPEDEPTH  16         // batches queued per inserter
+
+// reader stage: oldText[0..ready) has been read
+typedef struct {
+  pthread_t thread;
+  Source *src;
+  PosType ready;
+  pthread_mutex_t lock;
+  pthread_cond_t more;
+} Reader;
+
+Reader reader = {0, NULL, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+typedef struct {
+  int n;
+  int ht[BATCH];
+  Hptr nodes[BATCH];
+} Batch;
+
+
+#ifdef HAVE_ZSTD
+// zstd frames decoded in parallel: done[] and first (the first not done) under the lock of the reader
+typedef struct {
+  Reader *r;
+  _Atomic int next;
+  char *done;
+  int first;
+} FrameWork;
+
+void *frameThread(void *arg)
+{
+  FrameWork *w = (FrameWork *) arg;
+  Source *s = w->r->src;
+  ZSTD_DCtx *dctx = ZSTD_createDCtx();
+  int i;
+  while ((i = atomic_fetch_add(&w->next, 1)) < s->nframes) {
+    size_t start = s->frameStart[i], length = s->frameOffset[i+1] - s->frameOffset[i];
+    size_t n = ZSTD_decompressDCtx(dctx, oldText + s->frameOffset[i], length, s->data + start,
+				   ZSTD_findFrameCompressedSize(s->data + start, s->size - start));
+    assert(!ZSTD_isError(n) && n == length, "Error: corrupted zstd file");
+    pthread_mutex_lock(&w->r->lock);
+    w->done[i] = 1;
+    while (w->first < s->nframes && w->done[w->first]) w->first++;
+    w->r->ready = s->frameOffset[w->first];
+    pthread_cond_broadcast(&w->r->more);
+    pthread_mutex_unlock(&w->r->lock);
+  }
+  ZSTD_freeDCtx(dctx);
+  return NULL;
+}
+
+static void readFrames(Reader *r)
+{
+  int nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads > r->src->nframes) nthreads = r->src->nframes;
+  if (nthreads < 1) nthreads = 1;
+  FrameWork w = {r, 0, (char *) calloc(r->src->nframes, 1), 0};
+  pthread_t threads[nthreads];
+  assert(w.done != 0, "malloc died in readFrames");
+  for (int t = 0; t < nthreads; t++)
+    assert(pthread_create(&threads[t], NULL, frameThread, &w) == 0, "Error: unable to start the decoders");
+  for (int t = 0; t < nthreads; t++)
+    pthread_join(threads[t], NULL);
+  free(w.done);
+}
+#endif
+
+void *readerThread(void *arg)
+{
+  Reader *r = (Reader *) arg;
+#ifdef HAVE_ZSTD
+  if (r->src->format == FORMAT_ZSTD && r->src->nframes > 1) {
+    readFrames(r);
+    return NULL;
+  }
+#endif
+  timelineName("reader");
+  if (r->src->format == FORMAT_PLAIN) posix_fadvise(fileno(r->src->f), 0, 0, POSIX_FADV_SEQUENTIAL);
+  for (PosType done = 0; done < oldTextLength; ) {
+    PosType n = (oldTextLength - done < READ_CHUNK) ? oldTextLength - done : READ_CHUNK;
+    double start = spanBegin();
+    n = sourceRead(r->src, oldText + done, n);
+    spanEnd("read", start);
+    assert(r->src->error == NULL, r->src->error);
+    assert(n > 0, "Error: reading the file to index");
+    done += n;
+    pthread_mutex_lock(&r->lock);
+    r->ready = done;
+    pthread_cond_broadcast(&r->more);
+    pthread_mutex_unlock(&r->lock);
+  }
+  return NULL;
+}
+
+// read the oldTextLength bytes of src in oldText, in the background
+void startReader(Source *src)
+{
+  reader.src = src;
+  reader.ready = 0;
+  assert(pthread_create(&reader.thread, NULL, readerThread, &reader) == 0, "Error: unable to start the reader");
+}
+
+// wait until oldText[0..upTo) is read, returns how much is
+PosType waitText(PosType upTo)
+{
+  double start = spanBegin();
+  pthread_mutex_lock(&reader.lock);
+  while (reader.ready < upTo) pthread_cond_wait(&reader.more, &reader.lock);
+  PosType ready = reader.ready;
+  pthread_mutex_unlock(&reader.lock);
+  spanEnd("wait text", start);
+  return ready;
+}
+
+void finishReader()
+{
+  pthread_join(reader.thread, NULL);
+  sourceClose(reader.src);
+  reader.src = NULL;
+  oldText[oldTextLength] = 0; // ended by \0
+}
+
+void *inserterThread(void *arg)
+{
+  Batch *b;
+  timelineName("inserter");
+  while ((b = (Batch *) queueGet((Queue *) arg)) != NULL) {
+    double start = spanBegin();
+    for (int k = 0; k < b->n; k++)
+      linkNode(b->nodes[k], b->ht[k]);
+    spanEnd("insert", start);
+    free(b);
+  }
+  return NULL;
+}
+
+// build the hash table of the windows of length queryLen of oldText, while the reader reads it
+void buildHtab(int blockSize)
+{
+  int queryLen = 4 * blockSize, qgramSize = 2 * blockSize;
+  int nparts = (int) sysconf(_SC_NPROCESSORS_ONLN) - 1;
+  if (nparts > NPARTS) nparts = NPARTS;
+  if (nparts < 1) nparts = 1;
+  Queue parts[nparts];
+  pthread_t inserters[nparts];
+  Batch *batch[nparts];
+  for (int p = 0; p < nparts; p++) {
+    queueInit(&parts[p], PIPEDEPTH);
+    batch[p] = (Batch *) malloc(sizeof(Batch));
+    assert(batch[p] != 0, "malloc died in buildHtab");
+    batch[p]->n = 0;
+    assert(pthread_create(&inserters[p], NULL, inserterThread, &parts[p]) == 0, "Error: unable to start the inserters");
+  }
+
+  PosType ready = 0;
+  double hashed = spanBegin();
+  for (PosType i = 0; i < oldTextLength-queryLen+1; i++) {
+    if (i + queryLen > ready) ready = waitText(i + queryLen);
+    if (i % TIMELINE_WINDOWS == TIMELINE_WINDOWS - 1) {
+      spanEnd("partition", hashed);  // hash the windows, and hand their nodes to the inserters
+      hashed = spanBegin();
+    }
+
+    if (TRACING(TRACE_BUILD)) {
+      flockfile(stderr);       // once for all the prints of the window
+      fprintf(stderr,"\n\n %ld - check:",(long) i);
+      printBlock(oldText+i,queryLen);
+      fprintf(stderr, "\n");
+    }
+	
+    // Take a qgram as 2 blocks, each of size blockSize characters
+    for(int first=0; first < 3; first++){
+      for(int second = first+1; second <= 3; second++){
+	
+	unsigned char *blockTmp = (unsigned char *) arenaAlloc(&nodeArena, qgramSize+1);  //allocate memory for the block
+	blockTmp[qgramSize] = 0;
+	for(int l=0; l < blockSize; l++){
+	  blockTmp[l] = oldText[i + first * blockSize + l];
+	  blockTmp[l+blockSize] = oldText[i + second * blockSize + l];
+	}
+	
+	if (TRACING(TRACE_BUILD)) {
+	  printBlock(blockTmp,qgramSize);
+	  fprintf(stderr, "\n");
+	}
+
+	int ht;
+	Hptr p = newNode(i, qgramSize, blockTmp, first, second, &ht);
+	Batch *b = batch[ht % nparts];
+	b->ht[b->n] = ht;
+	b->nodes[b->n++] = p;
+	if (b->n == BATCH) {
+	  queuePut(&parts[ht % nparts], b);
+	  batch[ht % nparts] = b = (Batch *) malloc(sizeof(Batch));
+	  assert(b != 0, "malloc died in buildHtab");
+	  b->n = 0;
+	}
+      } // end second
+    } // end first
+
+    if (TRACING(TRACE_BUILD)) funlockfile(stderr);
+    if (i % 1000000 == 0) fprintf(stderr, ".");
+
+  }
+
+  spanEnd("partition", hashed);
+  hashed = spanBegin();
+  for (int p = 0; p < nparts; p++) {
+    queuePut(&parts[p], batch[p]);
+    queueClose(&parts[p]);
+    pthread_join(inserters[p], NULL);
+    queueDestroy(&parts[p]);
+  }
+  spanEnd("wait inserters", hashed);
+  if (oldTextLength >= queryLen) {
+    statAdd(&stats.positions, oldTextLength - queryLen + 1);
+    statAdd(&stats.entries, 6 * (uint64_t) (oldTextLength - queryLen + 1));
+  }
+}
+
+
+
+// ----- TEXT IN COMPRESSED BLOCKS -----
+//
+// The text of the static index may be stored compressed (-z): in blocks of
+// TEXT_BLOCK bytes compressed one by one, with a table of where each block
+// starts, so that reading a few bytes of text decodes only the block holding
+// them. Each thread keeps the last blocks it decoded in a small cache of its
+// own: the candidates of a query are often close to each other, and so are
+// the windows of the queries that follow.
+
+
+#define TEXT_PLAIN 0               // the text as it is
+#define TEXT_ZLIB  1
+#define TEXT_ZSTD  2
+
+#define TEXT_BLOCK (64 << 10)      // bytes of text in a compressed block
+#define TEXT_CACHE 8               // decoded blocks cached by each thread
+
+int textCodec = TEXT_PLAIN;        // of the text of the static indexes built
+
+typedef struct {
+  uint64_t image;                  // id of the index whose block it is, 0 if the entry is free
+  uint64_t block;
+  uint64_t used;                   // tick of its last use
+  unsigned char *bytes;            // TEXT_BLOCK bytes
+} CachedBlock;
+
+__thread CachedBlock textCache[TEXT_CACHE];
+__thread uint64_t textTick = 0;
+_Atomic uint64_t imageIds = 0;     // every index image gets an id, for the caches
+
+
+// the codec of -z: the fastest to decode among those compiled in
+int packCodec()
+{
+#if defined(HAVE_ZSTD)
+  return TEXT_ZSTD;
+#elif defined(HAVE_ZLIB)
+  return TEXT_ZLIB;
+#else
+  assert(0, "Error, -z needs a codec: compile with -DHAVE_ZSTD -lzstd or -DHAVE_ZLIB -lz");
+  return TEXT_PLAIN;
+#endif
+}
+
+// 1 iff blocks of codec can be decoded by this build
+int hasCodec(int codec)
+{
+#ifdef HAVE_ZLIB
+  if (codec == TEXT_ZLIB) return 1;
+#endif
+#ifdef HAVE_ZSTD
+  if (codec == TEXT_ZSTD) return 1;
+#endif
+  return codec == TEXT_PLAIN;
+}
+
+// bytes enough to hold n bytes compressed with codec
+size_t packBound(int codec, size_t n)
+{
+#ifdef HAVE_ZLIB
+  if (codec == TEXT_ZLIB) return compressBound(n);
+#endif
+#ifdef HAVE_ZSTD
+  if (codec == TEXT_ZSTD) return ZSTD_compressBound(n);
+#endif
+  (void) codec;
+  return n;
+}
+
+// compress src[0..n) in dst (packBound() bytes), returns the compressed size
+size_t packBlock(int codec, unsigned char *dst, unsigned char *src, size_t n)
+{
+#ifdef HAVE_ZLIB
+  if (codec == TEXT_ZLIB) {
+    uLongf m = packBound(codec, n);
+    assert(compress2(dst, &m, src, n, Z_DEFAULT_COMPRESSION) == Z_OK, "Error: compressing the text");
+    return m;
+  }
+#endif
+#ifdef HAVE_ZSTD
+  if (codec == TEXT_ZSTD) {
+    size_t size = ZSTD_compress(dst, packBound(codec, n), src, n, 3);
+    assert(!ZSTD_isError(size), "Error: compressing the text");
+    return size;
+  }
+#endif
+  (void) codec;
+  memcpy(dst, src, n);
+  return n;
+}
+
+// decompress the block src[0..size) holding n bytes of text in dst: 0 if it is corrupted
+int unpackBlock(int codec, unsigned char *dst, size_t n, unsigned char *src, size_t size)
+{
+#ifdef HAVE_ZLIB
+  if (codec == TEXT_ZLIB) {
+    uLongf m = n;
+    return uncompress(dst, &m, src, size) == Z_OK && m == n;
+  }
+#endif
+#ifdef HAVE_ZSTD
+  if (codec == TEXT_ZSTD) return ZSTD_decompress(dst, n, src, size) == n;
+#endif
+  (void) codec; (void) dst; (void) n; (void) src; (void) size;
+  return 0;
+}
+
+// compress text[0..len) block by block: the blocks follow each other in *packed
+// (malloc'ed), block b starts at offsets[b] (offsets has a block more, the end);
+// returns the size of all of them
+uint64_t packText(int codec, unsigned char *text, PosType len, unsigned char **packed, uint64_t *offsets)
+{
+  uint64_t nblocks = (len + TEXT_BLOCK - 1) / TEXT_BLOCK, size = 0;
+  *packed = (unsigned char *) malloc(nblocks * packBound(codec, TEXT_BLOCK) + 1);
+  assert(*packed != 0, "malloc died in compressing the text");
+  for (uint64_t b = 0; b < nblocks; b++) {
+    PosType n = (len - (PosType) b * TEXT_BLOCK < TEXT_BLOCK) ? len - (PosType) b * TEXT_BLOCK : TEXT_BLOCK;
+    offsets[b] = size;
+    size += packBlock(codec, *packed + size, text + b * TEXT_BLOCK, n);
+  }
+  offsets[nblocks] = size;
+  return size;
+}
+
+// block b of the text of index image (compressed in src[0..size), n bytes decoded),
+// decoded by the cache of the thread
+unsigned char *cachedBlock(uint64_t image, uint64_t b, int codec, unsigned char *src, size_t size, size_t n)
+{
+  CachedBlock *victim = &textCache[0];
+  for (int i = 0; i < TEXT_CACHE; i++) {
+    CachedBlock *c = &textCache[i];
+    if (c->image == image && c->block == b) {
+      c->used = ++textTick;
+      return c->bytes;
+    }
+    if (c->used < victim->used) victim = c;
+  }
+
+  if (victim->bytes == NULL) {
+    victim->bytes = (unsigned char *) malloc(TEXT_BLOCK);
+    assert(victim->bytes != 0, "malloc died in decoding the text");
+  }
+  victim->image = 0;
+  assert(unpackBlock(codec, victim->bytes, n, src, size), "Error: corrupted text block in the index");
+  victim->image = image;
+  victim->block = b;
+  victim->used = ++textTick;
+  return victim->bytes;
+}
+
+// the thread is ending: its decoded blocks go
+void textCacheFree()
+{
+  for (int i = 0; i < TEXT_CACHE; i++) free(textCache[i].bytes);
+  memset(textCache, 0, sizeof(textCache));
+}
+
+
+
+// ----- STATIC INDEX AND INDEX FILE -----
+//
+// The pair-qgrams are stored in one array grouped by bucket (a bucket
+// directory gives where each bucket starts), and their content is not
+// stored: it is compared against the text, which is part of the index.
+// The index is built directly in its file image, so saving it is one
+// write and loading it is one mmap: all references are offsets from the
+// start of the image, and no deserialization takes place. An index whose
+// text is compressed in blocks has version 2, which older builds refuse.
+
+
+#define INDEX_MAGIC   "AI2HAMIX"
+#define INDEX_VERSION 1
+#define INDEX_VERSION_PACKED 2 // the text is stored in compressed blocks
+#define INDEX_ALIGN   64       // every section starts at a multiple of this
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t blockSize;        // pieces have this length, queries are 4 times longer
+  uint32_t k;                // mismatches answered by the index
+  uint32_t entrySize;        // sizeof(Pentry), to refuse files of a different layout
+  uint64_t hashSeed;
+  uint64_t textLength;
+  uint64_t textChecksum;     // FNV-1a of the text
+  uint64_t nbuckets;
+  uint64_t nentries;
+  uint64_t bucketsOffset;    // uint64_t[nbuckets+1]: first entry of each bucket
+  uint64_t entriesOffset;    // Pentry[nentries], grouped by bucket
+  uint64_t textOffset;       // textLength bytes followed by a \0, or the compressed blocks of the text
+  uint64_t fileSize;
+  uint32_t textCodec;        // TEXT_PLAIN, or the codec of the blocks
+  uint32_t textBlock;        // bytes of text in a block
+  uint64_t textBlocksOffset; // uint64_t[nblocks+1]: where each block starts, from textOffset
+} IndexHeader;
+
+typedef struct {
+  PosType pos;               // starting position of the qgram
+  uint32_t sig;              // hashBlock() of the qgram
+  uint8_t firstBlockPos;
+  uint8_t secondBlockPos;
+  uint16_t pad;
+} Pentry;
+
+typedef struct staticIndex {
+  IndexHeader *hdr;
+  uint64_t *buckets;
+  Pentry *entries;
+  unsigned char *text;
+  uint64_t *textBlocks;      // NULL if the text is not compressed
+  uint64_t id;               // of the image, for the caches of decoded blocks
+  void *image;               // memory holding the index, the replicas aside
+  size_t mapSize;            // > 0 iff the image is mmapped
+  void *replica[MAXNODES];   // NUMA_REPLICATE: a copy of the image per node
+  struct tier *tier;         // -T: the long lists of entries are read from disk, NULL if not
+  int refs;                  // versions holding the index
+  int chainsKnown;           // chains is filled (by the build, the tiering or the first -J dump)
+  uint64_t chains[STAT_BINS]; // buckets by their number of entries, for -J
+} StaticIndex;
+
+// lists of entries kept on disk, defined with them
+size_t tierBudget = 0;       // -T: bytes of the cache of long lists, 0 keeps all the index in memory
+int verifyIndex = 0;         // -V: read the whole directory and text of a mapped index
+void tierStatic(StaticIndex *x, int fd);
+Pentry *tierList(struct tier *t, uint64_t b, uint64_t first, uint64_t n);
+void tierFree(struct tier *t);
+
+__thread int queryNode = -1; // node whose replica the thread queries, if any
+
+
+#define TEXT_CHECKSUM 14695981039346656037ULL   // of an empty text
+
+// the checksum of a text ending with text[0..len), h being the one of what is before
+uint64_t checksumMore(uint64_t h, unsigned char *text, size_t len)
+{
+  for (size_t i = 0; i < len; i++) {
+    h ^= text[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+uint64_t textChecksum(unsigned char *text, PosType len)
+{
+  return checksumMore(TEXT_CHECKSUM, text, len);
+}
+
+// the checksum of the text of x, as saved in its header
+uint64_t staticChecksum(StaticIndex *x)
+{
+  return x->hdr->textChecksum;
+}
+
+static uint64_t alignUp(uint64_t x)
+{
+  return (x + INDEX_ALIGN - 1) & ~((uint64_t) INDEX_ALIGN - 1);
+}
+
+// set the pointers of x to the sections of the image at base
+void attachStatic(StaticIndex *x, void *base)
+{
+  x->hdr = (IndexHeader *) base;
+  x->buckets = (uint64_t *) ((char *) base + x->hdr->bucketsOffset);
+  x->entries = (Pentry *) ((char *) base + x->hdr->entriesOffset);
+  x->text = (unsigned char *) base + x->hdr->textOffset;
+  x->textBlocks = x->hdr->textCodec ? (uint64_t *) ((char *) base + x->hdr->textBlocksOffset) : NULL;
+}
+
+// copy text[pos..pos+len) of the index x in dst, decoding the blocks holding it
+void staticRead(StaticIndex *x, unsigned char *dst, PosType pos, PosType len)
+{
+  if (x->textBlocks == NULL) {
+    memcpy(dst, x->text + pos, len);
+    return;
+  }
+  PosType blockLen = x->hdr->textBlock;
+  uint64_t nblocks = (x->hdr->textLength + blockLen - 1) / blockLen;
+  while (len > 0) {
+    uint64_t b = pos / blockLen;
+    assert(x->textBlocks[b] <= x->textBlocks[b+1] && x->textBlocks[b+1] <= x->textBlocks[nblocks],
+	   "Error: corrupted text block in the index");
+    PosType off = pos % blockLen, start = (PosType) b * blockLen;
+    PosType n = ((PosType) x->hdr->textLength - start < blockLen) ? (PosType) x->hdr->textLength - start : blockLen;
+    unsigned char *bytes = cachedBlock(x->id, b, x->hdr->textCodec, x->text + x->textBlocks[b],
+				       x->textBlocks[b+1] - x->textBlocks[b], n);
+    n = (len < n - off) ? len : n - off;
+    memcpy(dst, bytes + off, n);
+    dst += n; pos += n; len -= n;
+  }
+}
+
+// text[pos..pos+len) of the index x: in place, or decoded in buf if it is compressed
+static inline unsigned char *staticText(StaticIndex *x, unsigned char *buf, PosType pos, PosType len)
+{
+  if (x->textBlocks == NULL) return x->text + pos;
+  staticRead(x, buf, pos, len);
+  return buf;
+}
+
+// pair key of the qgram starting at i: pieces first and second of length blockSize
+static void pairKey(unsigned char *key, unsigned char *text, PosType i, int blockSize, int first, int second)
+{
+  memcpy(key, text + i + first * blockSize, blockSize);
+  memcpy(key + blockSize, text + i + second * blockSize, blockSize);
+}
+
+// Image of size bytes, zero filled: on the heap if shmName is NULL, otherwise in
+// the named shared-memory segment (a name like "/idx") or in the file shmName
+// (a path like "/dev/hugepages/idx", then the size is rounded to 2MB pages),
+// which any number of processes can later map read-only with attachShared().
+// A segment of the same name is replaced, not truncated: the processes
+// attached to it keep it
+void *createImage(size_t size, const char *shmName, size_t *mapSize)
+{
+  *mapSize = 0;
+  if (shmName == NULL) return indexAlloc(size, "static index");
+
+  int isPath = (strchr(shmName + 1, '/') != NULL);
+  if (isPath) unlink(shmName);
+  else shm_unlink(shmName);
+  int fd = isPath ? open(shmName, O_RDWR | O_CREAT | O_EXCL, 0644)
+		  : shm_open(shmName, O_RDWR | O_CREAT | O_EXCL, 0644);
+  assert(fd >= 0, "Error: Unable to create the shared index");
+  if (isPath) size = (size + (2 << 20) - 1) & ~((size_t) (2 << 20) - 1);
+  assert(ftruncate(fd, size) == 0, "Error: Unable to size the shared index");
+  void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  assert(base != MAP_FAILED, "Error: mmap of the shared index failed");
+  close(fd);
+  *mapSize = size;
+  // huge pages of shared memory come from THP (shmem_enabled) or from hugetlbfs paths
+  addRegion(base, size, "shared index", placeRegion(base, size, hugePages ? PAGES_THP : PAGES_DEFAULT,
+						     (numaPolicy == NUMA_LOCAL) ? numaNode : -1), size);
+  return base;
+}
+
+// the text is stored compressed with codec, unless it is TEXT_PLAIN; the magic
+// of the header is written last, a process attaching to shmName before sees
+// an index being built
+void buildStatic(StaticIndex *x, unsigned char *text, PosType len, int blockSize, int codec, const char *shmName)
+{
+  int queryLen = 4 * blockSize, qgramSize = 2 * blockSize;
+  PosType npos = (len >= queryLen) ? len - queryLen + 1 : 0;
+  uint64_t nentries = 6 * (uint64_t) (npos - deletedIn(0, npos));   // tombstoned windows are dropped
+  uint64_t nbuckets = nentries / 4 + 1;
+  unsigned char key[qgramSize];
+  statAdd(&stats.positions, nentries / 6);
+  statAdd(&stats.entries, nentries);
+
+  IndexHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, INDEX_MAGIC, 8);
+  h.version = INDEX_VERSION;
+  h.blockSize = blockSize;
+  h.k = MAXMISMATCHES;
+  h.entrySize = sizeof(Pentry);
+  h.hashSeed = hashSeed;
+  h.textLength = len;
+  h.textChecksum = textChecksum(text, len);
+  h.nbuckets = nbuckets;
+  h.nentries = nentries;
+  h.bucketsOffset = alignUp(sizeof(IndexHeader));
+  h.entriesOffset = alignUp(h.bucketsOffset + (nbuckets + 1) * sizeof(uint64_t));
+  h.textOffset = alignUp(h.entriesOffset + nentries * sizeof(Pentry));
+  h.fileSize = alignUp(h.textOffset + len + 1);
+
+  // a compressed text is compressed first: its size fixes the one of the image
+  unsigned char *packed = NULL;
+  uint64_t nblocks = (len + TEXT_BLOCK - 1) / TEXT_BLOCK, packedSize = 0, *offsets = NULL;
+  if (codec != TEXT_PLAIN) {
+    offsets = (uint64_t *) malloc((nblocks + 1) * sizeof(uint64_t));
+    assert(offsets != 0, "malloc died in static index construction");
+    packedSize = packText(codec, text, len, &packed, offsets);
+    h.version = INDEX_VERSION_PACKED;
+    h.textCodec = codec;
+    h.textBlock = TEXT_BLOCK;
+    h.textBlocksOffset = alignUp(h.textOffset + packedSize);
+    h.fileSize = alignUp(h.textBlocksOffset + (nblocks + 1) * sizeof(uint64_t));
+  }
+
+  size_t mapSize;
+  void *base = createImage(h.fileSize, shmName, &mapSize);
+  assert(base != 0, "malloc died in static index construction");
+  memcpy(base, &h, sizeof(h));
+  memset(base, 0, 8);
+  attachStatic(x, base);
+  if (codec == TEXT_PLAIN) memcpy(x->text, text, len);
+  else {
+    memcpy(x->text, packed, packedSize);
+    memcpy(x->textBlocks, offsets, (nblocks + 1) * sizeof(uint64_t));
+    free(packed);
+    free(offsets);
+  }
+  x->image = base;
+  x->mapSize = mapSize;
+  x->id = ++imageIds;
+
+  // count the qgrams of each bucket, then place them (bucket order, then position)
+  for (PosType i = 0; i < npos; i++)
+    if (!isDeleted(i))
+    for (int first = 0; first < 3; first++)
+      for (int second = first+1; second <= 3; second++) {
+	pairKey(key, text, i, blockSize, first, second);
+	x->buckets[hashKey(qgramSize, key) % nbuckets + 1]++;
+      }
+  memset(x->chains, 0, sizeof(x->chains));
+  for (uint64_t b = 0; b < nbuckets; b++) {
+    x->chains[statBin(x->buckets[b+1])]++;
+    x->buckets[b+1] += x->buckets[b];
+  }
+  x->chainsKnown = 1;
+
+  uint64_t *fill = (uint64_t *) malloc(nbuckets * sizeof(uint64_t));
+  assert(fill != 0, "malloc died in static index construction");
+  memcpy(fill, x->buckets, nbuckets * sizeof(uint64_t));
+  for (PosType i = 0; i < npos; i++)
+    if (!isDeleted(i))
+    for (int first = 0; first < 3; first++)
+      for (int second = first+1; second <= 3; second++) {
+	pairKey(key, text, i, blockSize, first, second);
+	Pentry *e = &x->entries[fill[hashKey(qgramSize, key) % nbuckets]++];
+	e->pos = i;
+	e->sig = (uint32_t) hashBlock(qgramSize, key);
+	e->firstBlockPos = first;
+	e->secondBlockPos = second;
+      }
+  free(fill);
+  atomic_thread_fence(memory_order_release);
+  memcpy(x->hdr->magic, INDEX_MAGIC, 8);
+
+  fprintf(stderr, " static index: %llu bytes (%.2f per text byte)",
+	  (unsigned long long) h.fileSize, (double) h.fileSize / (len ? len : 1));
+  if (codec != TEXT_PLAIN)
+    fprintf(stderr, ", text compressed to %llu bytes in %llu blocks",
+	    (unsigned long long) packedSize, (unsigned long long) nblocks);
+}
+
+// NUMA_REPLICATE: one copy of the static index per node
+void replicateStatic(StaticIndex *x)
+{
+  size_t size = x->hdr->fileSize;
+  for (int node = 0; node < numaNodes; node++) {
+    int pages;
+    size_t length;
+    x->replica[node] = mapRegion(size, node, &pages, &length);
+    memcpy(x->replica[node], x->hdr, size);
+    addRegion(x->replica[node], size, "static replica", pages, length);
+  }
+}
+
+void destroyStatic(StaticIndex *x)
+{
+  if (x->tier != NULL) tierFree(x->tier);
+  for (int node = 0; node < MAXNODES; node++)
+    indexFree(x->replica[node]);
+  indexFree(x->image);
+  memset(x, 0, sizeof(*x));
+}
+
+void retainStatic(StaticIndex *x)
+{
+  x->refs++;
+}
+
+void releaseStatic(StaticIndex *x)
+{
+  if (--x->refs > 0) return;
+  destroyStatic(x);
+  free(x);
+}
+
+// make durable a rename to fileName, by syncing the directory holding it
+void syncDirectory(const char *fileName)
+{
+  char dir[4096];
+  snprintf(dir, sizeof(dir), "%s", fileName);
+  char *slash = strrchr(dir, '/');
+  if (slash == NULL) strcpy(dir, ".");
+  else if (slash == dir) slash[1] = 0;
+  else *slash = 0;
+  int fd = open(dir, O_RDONLY | O_DIRECTORY);
+  assert(fd >= 0 && fsync(fd) == 0 && close(fd) == 0, "Error: syncing the directory of the index file");
+}
+
+// the file is written aside ("fileName.building"), synced and renamed: it is there
+// whole or not at all, also after a crash, and the processes mapping the old one keep it
+void saveStatic(StaticIndex *x, const char *fileName)
+{
+  char tmp[4096];
+  snprintf(tmp, sizeof(tmp), "%s.building", fileName);
+  FILE *f = fopen(tmp, "w");
+  assert(f != NULL, "Error: Unable to create the index file");
+  assert(fwrite(x->hdr, 1, x->hdr->fileSize, f) == x->hdr->fileSize, "Error: writing the index file");
+  assert(fflush(f) == 0 && fsync(fileno(f)) == 0 && fclose(f) == 0 && rename(tmp, fileName) == 0,
+	 "Error: writing the index file");
+  syncDirectory(fileName);
+}
+
+// what is wrong with the sections of the image h of size bytes: NULL if they
+// lie in order within it and its directory and block table end where they
+// should; the cost does not depend on the size of the index
+static const char *checkImage(IndexHeader *h, uint64_t size)
+{
+  char *base = (char *) h;
+  if (h->fileSize > size) return "Error: index file truncated";
+  size = h->fileSize;
+  int packed = (h->textCodec != TEXT_PLAIN);
+  uint64_t nblocks = packed ? h->textLength / h->textBlock + 1 : 0;
+  if (h->nbuckets == 0 || h->nbuckets >= size / sizeof(uint64_t) || h->nentries > size / sizeof(Pentry)
+      || (!packed && h->textLength >= size) || nblocks >= size / sizeof(uint64_t))
+    return "Error: index file corrupted (sizes)";
+  nblocks = packed ? (h->textLength + h->textBlock - 1) / h->textBlock : 0;
+  uint64_t bucketsEnd = h->bucketsOffset + (h->nbuckets + 1) * sizeof(uint64_t);
+  uint64_t entriesEnd = h->entriesOffset + h->nentries * sizeof(Pentry);
+  uint64_t textEnd = packed ? h->textBlocksOffset + (nblocks + 1) * sizeof(uint64_t) : h->textOffset + h->textLength;
+  if (h->bucketsOffset < sizeof(IndexHeader) || h->bucketsOffset % sizeof(uint64_t) != 0 || bucketsEnd > size
+      || h->entriesOffset < bucketsEnd || h->entriesOffset % sizeof(uint64_t) != 0 || entriesEnd > size
+      || h->textOffset < entriesEnd || h->textOffset > size
+      || (packed && (h->textBlocksOffset < h->textOffset || h->textBlocksOffset % sizeof(uint64_t) != 0))
+      || textEnd > size)
+    return "Error: index file corrupted (sections)";
+
+  uint64_t *buckets = (uint64_t *) (base + h->bucketsOffset);
+  if (buckets[0] != 0 || buckets[h->nbuckets] != h->nentries) return "Error: index file corrupted (directory)";
+  uint64_t *blocks = (uint64_t *) (base + h->textBlocksOffset);
+  if (packed && (blocks[0] != 0 || blocks[nblocks] > h->textBlocksOffset - h->textOffset))
+    return "Error: index file corrupted (blocks)";
+  return NULL;
+}
+
+// -V: what is wrong with the image h, checked by checkImage: NULL if its directory
+// and block table are sorted and its text (decoded if compressed) is the one
+// checksummed; it reads all of them
+static const char *verifyImage(IndexHeader *h)
+{
+  char *base = (char *) h;
+  int packed = (h->textCodec != TEXT_PLAIN);
+  uint64_t *buckets = (uint64_t *) (base + h->bucketsOffset);
+  for (uint64_t b = 0; b < h->nbuckets; b++)
+    if (buckets[b+1] < buckets[b]) return "Error: index file corrupted (directory)";
+
+  unsigned char *text = (unsigned char *) base + h->textOffset;
+  if (!packed) return (textChecksum(text, h->textLength) == h->textChecksum) ? NULL : "Error: the text of the index does not match its checksum";
+  uint64_t nblocks = (h->textLength + h->textBlock - 1) / h->textBlock;
+  uint64_t *blocks = (uint64_t *) (base + h->textBlocksOffset), c = TEXT_CHECKSUM;
+  for (uint64_t b = 0; b < nblocks; b++)
+    if (blocks[b+1] < blocks[b]) return "Error: index file corrupted (blocks)";
+  unsigned char *bytes = (unsigned char *) malloc(h->textBlock);
+  assert(bytes != 0, "malloc died in checking the index");
+  const char *err = NULL;
+  for (uint64_t b = 0; b < nblocks && err == NULL; b++) {
+    size_t n = (h->textLength - b * h->textBlock < h->textBlock) ? h->textLength - b * h->textBlock : h->textBlock;
+    if (!unpackBlock(h->textCodec, bytes, n, text + blocks[b], blocks[b+1] - blocks[b]))
+      err = "Error: the text of the index is corrupted";
+    else c = checksumMore(c, bytes, n);
+  }
+  free(bytes);
+  if (err == NULL && c != h->textChecksum) err = "Error: the text of the index does not match its checksum";
+  return err;
+}
+
+// map read-only the index image in fd (left open): NULL if it is usable, otherwise what is wrong with it
+const char *mapImage(StaticIndex *x, int fd)
+{
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(IndexHeader))
+    return "Error: index file too short";
+
+  void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) return "Error: mmap of the index file failed";
+
+  IndexHeader *h = (IndexHeader *) base;
+  const char *err = NULL;
+  static const char building[8];
+  if (memcmp(h->magic, building, 8) == 0) err = "Error: the index is still being built";
+  else if (memcmp(h->magic, INDEX_MAGIC, 8) != 0) err = "Error: not an index file";
+  else if ((!(h->version == INDEX_VERSION && h->textCodec == TEXT_PLAIN)
+	    && !(h->version == INDEX_VERSION_PACKED && h->textCodec != TEXT_PLAIN
+		 && h->textBlock > 0 && h->textBlock <= TEXT_BLOCK))
+	   || h->entrySize != sizeof(Pentry))
+    err = "Error: index file of an unsupported version";
+  else if (!hasCodec(h->textCodec))
+    err = "Error: the text of the index is compressed by a codec not compiled in";
+  else {
+    atomic_thread_fence(memory_order_acquire);   // the sections are read after the magic
+    err = checkImage(h, st.st_size);
+    if (err == NULL && verifyIndex) err = verifyImage(h);
+  }
+  if (err != NULL) {
+    munmap(base, st.st_size);
+    return err;
+  }
+  attachStatic(x, base);
+  x->image = base;
+  x->mapSize = st.st_size;
+  x->chainsKnown = 0;
+  memset(x->chains, 0, sizeof(x->chains));
+  x->id = ++imageIds;
+  addRegion(base, st.st_size, "mapped index", PAGES_DEFAULT, st.st_size);
+  return NULL;
+}
+
+// map the index image in fd: queries can start right after this returns
+void mapStatic(StaticIndex *x, int fd)
+{
+  const char *err = mapImage(x, fd);
+  assert(err == NULL, err);
+  hashSeed = x->hdr->hashSeed;
+}
+
+// fault in the pages of a mapped index before it gets queries
+void warmStatic(StaticIndex *x)
+{
+  volatile unsigned char sum = 0;
+  madvise(x->image, x->mapSize, MADV_WILLNEED);
+  for (size_t i = 0; i < x->mapSize; i += 4096)
+    sum += ((unsigned char *) x->image)[i];
+}
+
+// map the index file fileName, tiered with -T
+void loadStatic(StaticIndex *x, const char *fileName)
+{
+  int fd = open(fileName, O_RDONLY);
+  assert(fd >= 0, "Error: Unable to open the index file");
+  mapStatic(x, fd);
+  if (tierBudget > 0) tierStatic(x, fd);
+  close(fd);
+}
+
+// attach to an index published with createImage(): all the processes
+// attached to the same name share one copy of it in memory
+void attachShared(StaticIndex *x, const char *shmName)
+{
+  int fd = (strchr(shmName + 1, '/') != NULL) ? open(shmName, O_RDONLY) : shm_open(shmName, O_RDONLY, 0);
+  assert(fd >= 0, "Error: Unable to open the shared index");
+  mapStatic(x, fd);
+  close(fd);
+}
+
+// Search block of length "len" constructed from the firstPiece+secondPiece blocks, as search() does
+PosType *staticSearch(StaticIndex *x, unsigned char *block, int len, int firstPiece, int secondPiece)
+{
+  uint64_t b = hashKey(len, block) % x->hdr->nbuckets;
+  uint32_t hb = (uint32_t) hashBlock(len, block);
+  int blockSize = len / 2;
+  assert(x->buckets[b] <= x->buckets[b+1] && x->buckets[b+1] <= x->hdr->nentries,
+	 "Error: corrupted bucket directory in the index");
+
+  PosType *results = (PosType *) arenaAlloc(&scratch, sizeof(PosType) * (x->buckets[b+1] - x->buckets[b] + 1));
+  unsigned char *window = (x->textBlocks != NULL) ? (unsigned char *) arenaAlloc(&scratch, 2 * len) : NULL;
+  int j = 0;
+
+  uint64_t n = x->buckets[b+1] - x->buckets[b];
+  Pentry *list = (x->tier != NULL) ? tierList(x->tier, b, x->buckets[b], n) : x->entries + x->buckets[b];
+
+  // only the text of the entries whose signature matches is read (and decoded, if compressed)
+  for (uint64_t e = 0; e < n && !budgetTick(); e++) {
+    Pentry *p = &list[e];
+    if (p->sig != hb || p->firstBlockPos != firstPiece || p->secondBlockPos != secondPiece) continue;
+    unsigned char *w = staticText(x, window, p->pos, 2 * len);
+    if (memcmp(w + firstPiece * blockSize, block, blockSize) == 0
+	&& memcmp(w + secondPiece * blockSize, block + blockSize, blockSize) == 0
+	&& !isDeleted(p->pos)) {
+      if (budgetTake()) break;
+      results[j++] = p->pos;
+    }
+  }
+
+  results[j] = -1;
+  return results;
+}
+
+
+
+// ----- POSTING LISTS ON DISK -----
+//
+// An index larger than memory is queried with -T: the bucket directory and
+// the short lists of entries (the posting lists of the buckets) are kept in
+// memory, the long ones stay in the index file and are read at query time
+// with direct I/O, bypassing the page cache, into a cache of lists bounded
+// by the budget of -T and evicted least recently used first. The cache is
+// split in shards by bucket, each with its own lock, so that query threads
+// rarely wait for each other, and reads are done outside the locks.
+
+
+#define TIER_LIST   256        // lists of more entries than this stay on disk
+#define TIER_SHARDS 16
+#define TIER_ALIGN  4096       // of the offsets, sizes and buffers of direct I/O
+
+typedef struct cachedList {
+  uint64_t bucket;
+  Pentry *entries;
+  uint64_t n;
+  void *mem;                 // the aligned buffer read, holding entries
+  size_t size;
+  struct cachedList *newer, *older;   // LRU order
+  struct cachedList *chain;           // same slot of the shard
+} CachedList;
+
+typedef struct {
+  pthread_mutex_t lock;
+  CachedList **slots;
+  uint64_t nslots;
+  CachedList *newest, *oldest;
+  size_t bytes;
+  uint64_t hits, misses;
+} ListShard;
+
+typedef struct tier {
+  int fd;                    // the index file, with O_DIRECT if its file system allows
+  int direct;
+  uint64_t entriesOffset;
+  uint64_t *buckets;         // nbuckets+1: the bucket directory, in memory
+  Pentry *mapped;            // the entries in the mapping, read if the file cannot be
+  uint64_t *hotStart;        // nbuckets+1: where the short list of each bucket starts in hot
+  Pentry *hot;               // the short lists, in memory
+  size_t budget;             // bytes of a shard of the cache
+  ListShard shard[TIER_SHARDS];
+} Tier;
+
+_Atomic int tierFailed = 0;  // a read of a list failed, reported once
+
+
+// keep the long lists of the index x, mapped from fd, on disk: the bucket
+// directory and the short lists are copied in memory, the pages of the rest
+// of the entries are released
+void tierStatic(StaticIndex *x, int fd)
+{
+  uint64_t nbuckets = x->hdr->nbuckets, nhot = 0;
+  Tier *t = (Tier *) calloc(1, sizeof(Tier));
+  assert(t != 0, "malloc died in tiering the index");
+  t->fd = dup(fd);           // the same file as the mapping, even if it was renamed over since
+  assert(t->fd >= 0, "Error: Unable to open the index file");
+  t->direct = (fcntl(t->fd, F_SETFL, fcntl(t->fd, F_GETFL) | O_DIRECT) == 0);
+  if (!t->direct) posix_fadvise(t->fd, 0, 0, POSIX_FADV_RANDOM);   // e.g. tmpfs: the page cache is used
+  t->entriesOffset = x->hdr->entriesOffset;
+  t->mapped = x->entries;
+  t->budget = tierBudget / TIER_SHARDS;
+  t->buckets = (uint64_t *) indexAlloc((nbuckets + 1) * sizeof(uint64_t), "bucket directory");
+  assert(t->buckets != 0, "malloc died in tiering the index");
+  memcpy(t->buckets, x->buckets, (nbuckets + 1) * sizeof(uint64_t));
+  madvise(x->buckets, (nbuckets + 1) * sizeof(uint64_t), MADV_DONTNEED);
+  x->buckets = t->buckets;
+
+  memset(x->chains, 0, sizeof(x->chains));
+  for (uint64_t b = 0; b < nbuckets; b++) {
+    assert(x->buckets[b] <= x->buckets[b+1], "Error: corrupted bucket directory in the index");
+    x->chains[statBin(x->buckets[b+1] - x->buckets[b])]++;
+    if (x->buckets[b+1] - x->buckets[b] <= TIER_LIST) nhot += x->buckets[b+1] - x->buckets[b];
+  }
+  x->chainsKnown = 1;
+  t->hotStart = (uint64_t *) indexAlloc((nbuckets + 1) * sizeof(uint64_t), "tier directory");
+  t->hot = (Pentry *) indexAlloc((nhot + 1) * sizeof(Pentry), "short lists");
+  assert(t->hotStart != 0 && t->hot != 0, "malloc died in tiering the index");
+
+  // one sequential pass over the entries
+  madvise(x->entries, x->hdr->nentries * sizeof(Pentry), MADV_SEQUENTIAL);
+  nhot = 0;
+  for (uint64_t b = 0; b < nbuckets; b++) {
+    uint64_t n = x->buckets[b+1] - x->buckets[b];
+    t->hotStart[b] = nhot;
+    if (n > TIER_LIST) continue;
+    memcpy(t->hot + nhot, x->entries + x->buckets[b], n * sizeof(Pentry));
+    nhot += n;
+  }
+  t->hotStart[nbuckets] = nhot;
+  madvise(x->entries, x->hdr->nentries * sizeof(Pentry), MADV_DONTNEED);
+  posix_fadvise(t->fd, x->hdr->entriesOffset, x->hdr->nentries * sizeof(Pentry), POSIX_FADV_DONTNEED);
+
+  for (int s = 0; s < TIER_SHARDS; s++) {
+    ListShard *c = &t->shard[s];
+    pthread_mutex_init(&c->lock, NULL);
+    c->nslots = t->budget / (TIER_LIST * sizeof(Pentry)) + 1;
+    c->slots = (CachedList **) calloc(c->nslots, sizeof(CachedList *));
+    assert(c->slots != 0, "malloc died in tiering the index");
+  }
+  x->tier = t;
+  fprintf(stderr, " %llu entries in memory, %llu on disk%s...", (unsigned long long) nhot,
+	  (unsigned long long) (x->hdr->nentries - nhot), t->direct ? " (direct I/O)" : "");
+}
+
+void tierFree(Tier *t)
+{
+  uint64_t hits = 0, misses = 0;
+  for (int s = 0; s < TIER_SHARDS; s++) {
+    ListShard *c = &t->shard[s];
+    for (CachedList *l = c->newest, *next; l != NULL; l = next) {
+      next = l->older;
+      free(l->mem);
+      free(l);
+    }
+    free(c->slots);
+    pthread_mutex_destroy(&c->lock);
+    hits += c->hits;
+    misses += c->misses;
+  }
+  if (hits + misses > 0)
+    fprintf(stderr, "  long lists read: %llu from the cache, %llu from disk\n",
+	    (unsigned long long) hits, (unsigned long long) misses);
+  indexFree(t->buckets);
+  indexFree(t->hotStart);
+  indexFree(t->hot);
+  close(t->fd);
+  free(t);
+}
+
+// read the n entries of a long list, starting with entry first, in an aligned
+// buffer; NULL if the file cannot be read
+static CachedList *readList(Tier *t, uint64_t b, uint64_t first, uint64_t n)
+{
+  uint64_t from = t->entriesOffset + first * sizeof(Pentry), to = from + n * sizeof(Pentry);
+  uint64_t start = from & ~((uint64_t) TIER_ALIGN - 1);
+  size_t size = ((to - start) + TIER_ALIGN - 1) & ~((size_t) TIER_ALIGN - 1);
+  CachedList *l = (CachedList *) calloc(1, sizeof(CachedList));
+  assert(l != 0 && posix_memalign(&l->mem, TIER_ALIGN, size) == 0, "malloc died in reading a list");
+  for (size_t done = 0; done < to - start; ) {
+    ssize_t m = pread(t->fd, (char *) l->mem + done, size - done, start + done);
+    size_t aligned = (done + (m > 0 ? m : 0)) & ~((size_t) TIER_ALIGN - 1);
+    if (m <= 0 || (t->direct && done + m < to - start && aligned == done)) {
+      free(l->mem);
+      free(l);
+      return NULL;
+    }
+    // direct I/O goes on at an aligned offset: the end of a short read is read again
+    done = t->direct ? aligned : done + m;
+  }
+  l->bucket = b;
+  l->entries = (Pentry *) ((char *) l->mem + (from - start));
+  l->n = n;
+  l->size = size;
+  return l;
+}
+
+// the n entries of bucket b, starting with entry first: the short lists are in
+// memory, the long ones are copied from the cache (scratch memory)
+Pentry *tierList(Tier *t, uint64_t b, uint64_t first, uint64_t n)
+{
+  if (n <= TIER_LIST) return t->hot + t->hotStart[b];
+
+  ListShard *c = &t->shard[b % TIER_SHARDS];
+  uint64_t slot = (b / TIER_SHARDS) % c->nslots;
+  Pentry *copy = (Pentry *) arenaAlloc(&scratch, n * sizeof(Pentry));
+  pthread_mutex_lock(&c->lock);
+  CachedList *l = c->slots[slot];
+  while (l != NULL && l->bucket != b) l = l->chain;
+  if (l != NULL) {
+    c->hits++;
+    if (l != c->newest) {   // move it first in the LRU order
+      l->newer->older = l->older;
+      if (l->older) l->older->newer = l->newer;
+      else c->oldest = l->newer;
+      l->newer = NULL;
+      l->older = c->newest;
+      c->newest->newer = l;
+      c->newest = l;
+    }
+    memcpy(copy, l->entries, n * sizeof(Pentry));
+    pthread_mutex_unlock(&c->lock);
+    return copy;
+  }
+  c->misses++;
+  pthread_mutex_unlock(&c->lock);
+
+  l = readList(t, b, first, n);
+  if (l == NULL) {           // the pages of the mapping serve it
+    if (!atomic_exchange(&tierFailed, 1))
+      fprintf(stderr, "  reading a long list from the index file failed (%s), read through the mapping\n", strerror(errno));
+    memcpy(copy, t->mapped + first, n * sizeof(Pentry));
+    return copy;
+  }
+  memcpy(copy, l->entries, n * sizeof(Pentry));
+
+  pthread_mutex_lock(&c->lock);
+  CachedList *other = c->slots[slot];
+  while (other != NULL && other->bucket != b) other = other->chain;
+  if (other != NULL || l->size > t->budget) {   // read meanwhile by another thread, or too long to cache
+    pthread_mutex_unlock(&c->lock);
+    free(l->mem);
+    free(l);
+    return copy;
+  }
+  while (c->bytes + l->size > t->budget) {
+    CachedList *old = c->oldest, **p = &c->slots[(old->bucket / TIER_SHARDS) % c->nslots];
+    while (*p != old) p = &(*p)->chain;
+    *p = old->chain;
+    c->oldest = old->newer;
+    if (c->oldest) c->oldest->older = NULL;
+    else c->newest = NULL;
+    c->bytes -= old->size;
+    free(old->mem);
+    free(old);
+  }
+  l->chain = c->slots[slot];
+  c->slots[slot] = l;
+  l->older = c->newest;
+  if (c->newest) c->newest->newer = l;
+  else c->oldest = l;
+  c->newest = l;
+  c->bytes += l->size;
+  pthread_mutex_unlock(&c->lock);
+  return copy;
+}
+
+
+
+// ----- EXTERNAL-MEMORY BUILD -----
+//
+// Builds the index file of buildStatic()+saveStatic() within a memory
+// budget: the text is read in chunks, the entries of its pair-qgrams go to
+// a buffer that, once full, is sorted by bucket and written as a run; the
+// runs are then merged, and the merged stream fills the entries and the
+// bucket directory of the file sequentially. The text is copied last, and
+// the header, holding its checksum, written at the end (a compressed text
+// is compressed a block at a time while it is copied, and the size of the
+// file is only known then). The runs are kept
+// aside the index file ("index.run.N") and removed after the merge.
+//
+// The runs are checkpointed in "index.checkpoint" with the text position
+// their windows reach, once CHECKPOINT_BYTES of them were written since the
+// last checkpoint (they are made durable then): a build that dies restarts
+// from there, and only redoes the merge if all the runs were written. The
+// checkpoint holds a hash of the tombstones of -x, the runs lacking their
+// windows. The merge opens at
+// most MERGE_FANIN runs at once, each with a buffer of its share of the
+// budget: more runs are first merged that many at a time into longer ones,
+// each of them checkpointed as well.
+
+#define EXTERNAL_MIN_BUDGET (1 << 20)  // bytes of -M at least
+#define MERGE_BUFFER (64 << 10)        // bytes of buffer of a file merged, at least
+#define MERGE_FANIN  64                // runs merged at once at most, for the descriptors
+#define CHECKPOINT_BYTES (64 << 20)    // bytes of runs written between two checkpoints, at least
+
+
+typedef struct {
+  uint64_t bucket;
+  Pentry e;
+} Record;
+
+typedef struct {
+  FILE *f;
+  Record cur;
+  char *buffer;
+} Run;
+
+
+int record_cmp(const void *a, const void *b)
+{
+  const Record *x = (const Record *) a, *y = (const Record *) b;
+  if (x->bucket != y->bucket) return (x->bucket < y->bucket) ? -1 : 1;
+  if (x->e.pos != y->e.pos) return (x->e.pos < y->e.pos) ? -1 : 1;
+  if (x->e.firstBlockPos != y->e.firstBlockPos) return x->e.firstBlockPos - y->e.firstBlockPos;
+  return x->e.secondBlockPos - y->e.secondBlockPos;
+}
+
+typedef struct {
+  long length, mtime;        // of the text file
+  int blockSize;
+  unsigned long hashSeed;
+  unsigned long long nbuckets;
+  unsigned long long tombs;  // tombstonesHash()
+  int firstRun;              // the runs before it were merged into later ones
+  int nruns;                 // runs written, durably
+  long nextPos;              // they hold the windows before this position
+} Checkpoint;
+
+
+// sort the n records and write them as run number nruns of indexName
+static void writeRun(Record *recs, size_t n, const char *indexName, int nruns)
+{
+  double start = spanBegin();
+  char name[4096];
+  qsort(recs, n, sizeof(Record), &record_cmp);
+  snprintf(name, sizeof(name), "%s.run.%d", indexName, nruns);
+  FILE *f = fopen(name, "w");
+  assert(f != NULL, "Error: Unable to write a run of the external build");
+  assert(fwrite(recs, sizeof(Record), n, f) == n && fclose(f) == 0, "Error: writing a run of the external build");
+  spanEnd("run", start);
+}
+
+static void saveCheckpoint(const char *indexName, Checkpoint *c)
+{
+  char name[4096], tmp[4096];
+  snprintf(name, sizeof(name), "%s.checkpoint", indexName);
+  snprintf(tmp, sizeof(tmp), "%s.checkpoint.new", indexName);
+  FILE *f = fopen(tmp, "w");
+  assert(f != NULL, "Error: Unable to write the build checkpoint");
+  fprintf(f, "AI2HAMCK %ld %ld %d %lu %llu %llx %d %d %ld\n", c->length, c->mtime, c->blockSize,
+	  c->hashSeed, c->nbuckets, c->tombs, c->firstRun, c->nruns, c->nextPos);
+  assert(fflush(f) == 0 && fsync(fileno(f)) == 0 && fclose(f) == 0 && rename(tmp, name) == 0,
+	 "Error: writing the build checkpoint");
+  syncDirectory(name);
+}
+
+// make the runs written since the checkpoint c durable, then checkpoint the
+// nruns runs, holding the windows before nextPos
+static void checkpointRuns(const char *indexName, Checkpoint *c, int nruns, long nextPos)
+{
+  char name[4096];
+  for (int i = c->nruns; i < nruns; i++) {
+    snprintf(name, sizeof(name), "%s.run.%d", indexName, i);
+    int fd = open(name, O_RDONLY);
+    assert(fd >= 0 && fsync(fd) == 0 && close(fd) == 0, "Error: writing a run of the external build");
+  }
+  c->nruns = nruns;
+  c->nextPos = nextPos;
+  saveCheckpoint(indexName, c);
+}
+
+// 1 iff a checkpoint of the same build as c is found: its progress is copied in c
+static int loadCheckpoint(const char *indexName, Checkpoint *c)
+{
+  char name[4096];
+  Checkpoint k;
+  snprintf(name, sizeof(name), "%s.checkpoint", indexName);
+  FILE *f = fopen(name, "r");
+  if (f == NULL) return 0;
+  int ok = fscanf(f, "AI2HAMCK %ld %ld %d %lu %llu %llx %d %d %ld", &k.length, &k.mtime, &k.blockSize,
+		  &k.hashSeed, &k.nbuckets, &k.tombs, &k.firstRun, &k.nruns, &k.nextPos) == 9
+    && k.length == c->length && k.mtime == c->mtime && k.blockSize == c->blockSize
+    && k.hashSeed == c->hashSeed && k.nbuckets == c->nbuckets && k.tombs == c->tombs;
+  fclose(f);
+  if (!ok) return 0;
+  c->firstRun = k.firstRun;
+  c->nruns = k.nruns;
+  c->nextPos = k.nextPos;
+  return 1;
+}
+
+// sift down the heap of runs, ordered by their current record
+static void siftRuns(Run **heap, int n, int i)
+{
+  for (;;) {
+    int m = i, l = 2*i + 1, r = 2*i + 2;
+    if (l < n && record_cmp(&heap[l]->cur, &heap[m]->cur) < 0) m = l;
+    if (r < n && record_cmp(&heap[r]->cur, &heap[m]->cur) < 0) m = r;
+    if (m == i) return;
+    Run *t = heap[i]; heap[i] = heap[m]; heap[m] = t;
+    i = m;
+  }
+}
+
+typedef struct {
+  Run *runs;
+  Run **heap;                // those not exhausted, by their current record
+  int nruns, nheap;
+} Merge;
+
+// open the runs lo..hi-1 of indexName for a merge, with buffers of ioBuffer bytes
+static void mergeOpen(Merge *m, const char *indexName, int lo, int hi, size_t ioBuffer)
+{
+  char name[4096];
+  m->nruns = hi - lo;
+  m->nheap = 0;
+  m->runs = (Run *) calloc(m->nruns, sizeof(Run));
+  m->heap = (Run **) malloc(m->nruns * sizeof(Run *));
+  assert(m->runs != 0 && m->heap != 0, "malloc died in the external build");
+  for (int i = 0; i < m->nruns; i++) {
+    Run *r = &m->runs[i];
+    snprintf(name, sizeof(name), "%s.run.%d", indexName, lo + i);
+    r->f = fopen(name, "r");
+    assert(r->f != NULL, "Error: Unable to read a run of the external build");
+    r->buffer = (char *) malloc(ioBuffer);
+    assert(r->buffer != 0, "malloc died in the external build");
+    setvbuf(r->f, r->buffer, _IOFBF, ioBuffer);
+    if (fread(&r->cur, sizeof(Record), 1, r->f) == 1) m->heap[m->nheap++] = r;
+  }
+  for (int i = m->nheap / 2 - 1; i >= 0; i--) siftRuns(m->heap, m->nheap, i);
+}
+
+// the next record of the merge in *r: 0 once they are all out
+static int mergeNext(Merge *m, Record *r)
+{
+  if (m->nheap == 0) return 0;
+  Run *x = m->heap[0];
+  *r = x->cur;
+  if (fread(&x->cur, sizeof(Record), 1, x->f) != 1) m->heap[0] = m->heap[--m->nheap];
+  siftRuns(m->heap, m->nheap, 0);
+  return 1;
+}
+
+static void mergeClose(Merge *m)
+{
+  for (int i = 0; i < m->nruns; i++) {
+    fclose(m->runs[i].f);
+    free(m->runs[i].buffer);
+  }
+  free(m->runs);
+  free(m->heap);
+}
+
+static void removeRuns(const char *indexName, int lo, int hi)
+{
+  char name[4096];
+  for (int i = lo; i < hi; i++) {
+    snprintf(name, sizeof(name), "%s.run.%d", indexName, i);
+    unlink(name);
+  }
+}
+
+void buildExternal(const char *fileName, int blockSize, int codec, size_t budget, const char *indexName)
+{
+  int queryLen = 4 * blockSize, qgramSize = 2 * blockSize;
+  unsigned char key[qgramSize];
+  Source in;
+  if (!sourceOpen(&in, fileName)) {
+    fprintf(stderr,"\n\nError: Unable to open %s\n",fileName);
+    exit (8);  }
+  PosType len = in.length;
+  PosType npos = (len >= queryLen) ? len - queryLen + 1 : 0;
+
+  // the budget goes to the text of a chunk and to the entries of its windows,
+  // 6 records each, so that a run holds about one chunk
+  assert(budget >= EXTERNAL_MIN_BUDGET, "Error, the memory budget of -M is too small");
+  size_t chunk = budget / (6 * sizeof(Record) + 1);
+  size_t capacity = (budget - chunk - queryLen) / sizeof(Record);
+  size_t textSize = (chunk > TEXT_BLOCK) ? chunk : TEXT_BLOCK;   // the blocks of -z are copied through it too
+  unsigned char *text = (unsigned char *) malloc(textSize + queryLen);
+  Record *recs = (Record *) malloc(capacity * sizeof(Record));
+  assert(text != 0 && recs != 0, "malloc died in the external build");
+
+  IndexHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, INDEX_MAGIC, 8);
+  h.version = INDEX_VERSION;
+  h.blockSize = blockSize;
+  h.k = MAXMISMATCHES;
+  h.entrySize = sizeof(Pentry);
+  h.hashSeed = hashSeed;
+  h.textLength = len;
+  h.nentries = 6 * (uint64_t) (npos - deletedIn(0, npos));
+  h.nbuckets = h.nentries / 4 + 1;
+  statAdd(&stats.positions, h.nentries / 6);
+  statAdd(&stats.entries, h.nentries);
+  h.bucketsOffset = alignUp(sizeof(IndexHeader));
+  h.entriesOffset = alignUp(h.bucketsOffset + (h.nbuckets + 1) * sizeof(uint64_t));
+  h.textOffset = alignUp(h.entriesOffset + h.nentries * sizeof(Pentry));
+  h.fileSize = (codec == TEXT_PLAIN) ? alignUp(h.textOffset + len + 1) : h.textOffset;   // known at the end if compressed
+
+  // resume the build that wrote the checkpoint, if it is this one
+  struct stat st;
+  fstat(fileno(in.f), &st);
+  Checkpoint ck = {len, (long) st.st_mtime, blockSize, hashSeed, h.nbuckets, tombstonesHash(), 0, 0, 0};
+  if (loadCheckpoint(indexName, &ck))
+    fprintf(stderr, " resuming at position %ld with %d run(s) written...", ck.nextPos, ck.nruns - ck.firstRun);
+
+  // runs: the windows of a chunk of text at a time, a run ends between two windows;
+  // the text is read sequentially, text[0..have) holds the bytes from start on
+  size_t n = 0, have = 0, unsynced = 0;   // bytes of the runs since the checkpoint
+  int nruns = ck.nruns;
+  assert(sourceSkip(&in, ck.nextPos) || in.error == NULL, in.error);
+  for (PosType start = ck.nextPos; start < npos; start += chunk) {
+    PosType m = (npos - start < (PosType) chunk) ? npos - start : (PosType) chunk;
+    size_t need = m + queryLen - 1;
+    if (have < need) {
+      size_t got = sourceRead(&in, text + have, need - have);
+      assert(in.error == NULL, in.error);
+      assert(got == need - have, "Error: reading the text");
+    }
+    for (PosType i = 0; i < m; i++) {
+      if (n + 6 > capacity) {
+	writeRun(recs, n, indexName, nruns++);
+	unsynced += n * sizeof(Record);
+	n = 0;
+	if (unsynced >= CHECKPOINT_BYTES) {
+	  checkpointRuns(indexName, &ck, nruns, start + i);
+	  unsynced = 0;
+	}
+      }
+      if (!isDeleted(start + i))
+      for (int first = 0; first < 3; first++)
+	for (int second = first+1; second <= 3; second++) {
+	  Record *r = &recs[n++];
+	  memset(r, 0, sizeof(Record));
+	  pairKey(key, text, i, blockSize, first, second);
+	  r->bucket = hashKey(qgramSize, key) % h.nbuckets;
+	  r->e.pos = start + i;
+	  r->e.sig = (uint32_t) hashBlock(qgramSize, key);
+	  r->e.firstBlockPos = first;
+	  r->e.secondBlockPos = second;
+	}
+    }
+    memmove(text, text + m, need - m);   // the windows of the next chunk start there
+    have = need - m;
+  }
+  if (n > 0 || nruns == 0) writeRun(recs, n, indexName, nruns++);
+  if (ck.nruns < nruns || ck.nextPos < npos) checkpointRuns(indexName, &ck, nruns, npos);
+  free(recs);
+
+  // merge: fanIn runs at a time, each with a buffer of ioBuffer bytes (as
+  // the files written), into longer runs until the last ones fill the file
+  int fanIn = budget / MERGE_BUFFER - 2;
+  if (fanIn > MERGE_FANIN) fanIn = MERGE_FANIN;
+  size_t ioBuffer = budget / (fanIn + 2);
+  int firstRun = ck.firstRun, merged = nruns - firstRun;
+  char name[4096];
+  Merge m;
+  Record r;
+  double merging = spanBegin();
+  while (nruns - firstRun > fanIn) {
+    int last = firstRun + fanIn;
+    mergeOpen(&m, indexName, firstRun, last, ioBuffer);
+    snprintf(name, sizeof(name), "%s.run.%d", indexName, nruns);
+    FILE *f = fopen(name, "w");
+    char *buffer = (char *) malloc(ioBuffer);
+    assert(f != NULL && buffer != 0, "Error: Unable to write a run of the external build");
+    setvbuf(f, buffer, _IOFBF, ioBuffer);
+    while (mergeNext(&m, &r))
+      assert(fwrite(&r, sizeof(Record), 1, f) == 1, "Error: writing a run of the external build");
+    assert(fflush(f) == 0 && fsync(fileno(f)) == 0 && fclose(f) == 0, "Error: writing a run of the external build");
+    free(buffer);
+    mergeClose(&m);
+    ck.firstRun = last;
+    ck.nruns = ++nruns;
+    saveCheckpoint(indexName, &ck);
+    removeRuns(indexName, firstRun, last);
+    firstRun = last;
+  }
+
+  // the last merge: the entries and the directory of the file are written in order
+  snprintf(name, sizeof(name), "%s.building", indexName);
+  int fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  assert(fd >= 0 && ftruncate(fd, h.fileSize) == 0, "Error: Unable to create the index file");
+  FILE *entries = fdopen(fd, "w"), *dir = fopen(name, "r+");
+  char *entriesBuffer = (char *) malloc(ioBuffer), *dirBuffer = (char *) malloc(ioBuffer);
+  assert(entries != NULL && dir != NULL && entriesBuffer != 0 && dirBuffer != 0, "Error: Unable to create the index file");
+  setvbuf(entries, entriesBuffer, _IOFBF, ioBuffer);
+  setvbuf(dir, dirBuffer, _IOFBF, ioBuffer);
+  fseeko(entries, h.entriesOffset, SEEK_SET);
+  fseeko(dir, h.bucketsOffset, SEEK_SET);
+
+  mergeOpen(&m, indexName, firstRun, nruns, ioBuffer);
+  uint64_t written = 0, bucket = 0;
+  while (mergeNext(&m, &r)) {
+    for (; bucket <= r.bucket; bucket++)
+      fwrite(&written, sizeof(uint64_t), 1, dir);
+    fwrite(&r.e, sizeof(Pentry), 1, entries);
+    written++;
+  }
+  for (; bucket <= h.nbuckets; bucket++)
+    fwrite(&written, sizeof(uint64_t), 1, dir);
+  assert(written == h.nentries, "Error: entries lost in the external build");
+  mergeClose(&m);
+  spanEnd("merge", merging);
+  assert(fclose(dir) == 0, "Error: writing the index file");
+  free(dirBuffer);
+
+  // the text (or its blocks, then where they start), then the header with its checksum
+  uint64_t c = TEXT_CHECKSUM, nblocks = 0, packedSize = 0, *offsets = NULL;
+  unsigned char *packed = NULL;
+  size_t step = chunk;
+  if (codec != TEXT_PLAIN) {
+    nblocks = (len + TEXT_BLOCK - 1) / TEXT_BLOCK;
+    offsets = (uint64_t *) malloc((nblocks + 1) * sizeof(uint64_t));
+    packed = (unsigned char *) malloc(packBound(codec, TEXT_BLOCK));
+    assert(offsets != 0 && packed != 0, "malloc died in the external build");
+    step = TEXT_BLOCK;
+  }
+  sourceRewind(&in);
+  fseeko(entries, h.textOffset, SEEK_SET);
+  for (PosType done = 0; done < len; ) {
+    size_t m = sourceRead(&in, text, step);
+    assert(in.error == NULL, in.error);
+    assert(m > 0, "Error: reading the text");
+    c = checksumMore(c, text, m);
+    if (codec == TEXT_PLAIN) fwrite(text, 1, m, entries);
+    else {
+      offsets[done / TEXT_BLOCK] = packedSize;
+      size_t size = packBlock(codec, packed, text, m);
+      fwrite(packed, 1, size, entries);
+      packedSize += size;
+    }
+    done += m;
+  }
+  h.textChecksum = c;
+  if (codec != TEXT_PLAIN) {
+    offsets[nblocks] = packedSize;
+    h.version = INDEX_VERSION_PACKED;
+    h.textCodec = codec;
+    h.textBlock = TEXT_BLOCK;
+    h.textBlocksOffset = alignUp(h.textOffset + packedSize);
+    h.fileSize = alignUp(h.textBlocksOffset + (nblocks + 1) * sizeof(uint64_t));
+    fseeko(entries, h.textBlocksOffset, SEEK_SET);
+    fwrite(offsets, sizeof(uint64_t), nblocks + 1, entries);
+    assert(fflush(entries) == 0 && ftruncate(fileno(entries), h.fileSize) == 0, "Error: writing the index file");
+    free(offsets);
+    free(packed);
+  }
+  fseeko(entries, 0, SEEK_SET);
+  fwrite(&h, sizeof(h), 1, entries);
+  assert(fflush(entries) == 0 && fsync(fileno(entries)) == 0 && fclose(entries) == 0, "Error: writing the index file");
+  free(entriesBuffer);
+  sourceClose(&in);
+  free(text);
+
+  snprintf(name, sizeof(name), "%s.building", indexName);
+  assert(rename(name, indexName) == 0, "Error: replacing the index file");
+  syncDirectory(indexName);
+
+  // done, and durable: the runs and the checkpoint are not needed anymore
+  removeRuns(indexName, firstRun, nruns);
+  snprintf(name, sizeof(name), "%s.checkpoint", indexName);
+  unlink(name);
+  fprintf(stderr, " external build: %llu entries merged from %d run(s), %d at a time, %llu bytes",
+	  (unsigned long long) written, merged, fanIn, (unsigned long long) h.fileSize);
+}
+
+
+
+// ----- INCREMENTAL INDEXING OF APPENDED DATA -----
+//
+// The text may grow by appends after its static index was built. Every
+// append gets a small delta index: a chained hash table of the pair-qgrams
+// of the windows not indexed yet, those straddling the previous end of the
+// text included. Queries consult the static index and all the deltas of
+// their version; a background compaction rebuilds one static index out of
+// them, and the deltas it covers are dropped from the version publishing it.
+
+
+typedef struct dnode *Dptr;
+typedef struct dnode {
+  Dptr next;
+  PosType pos;               // starting position of the qgram
+  uint32_t sig;              // hashBlock() of the qgram
+  uint8_t firstBlockPos;
+  uint8_t secondBlockPos;
+} Dnode;
+
+typedef struct delta {
+  PosType start;             // text position of seg[0], the first window of the delta
+  PosType end;               // text length after the append
+  unsigned char *seg;        // text[start..end)
+  uint64_t nbuckets;
+  Dptr *heads;
+  Arena arena;               // seg, heads and nodes
+  int refs;                  // versions holding the delta
+} Delta;
+
+
+void retainDelta(Delta *d)
+{
+  d->refs++;
+}
+
+void releaseDelta(Delta *d)
+{
+  if (--d->refs > 0) return;
+  arenaFree(&d->arena);
+  free(d);
+}
+
+// length of the text indexed by v
+PosType indexedLength(IndexVersion *v)
+{
+  return v->ndeltas ? v->deltas[0]->end : (PosType) v->base->hdr->textLength;
+}
+
+// copy text[pos..pos+len) out of the static index and the deltas of v
+void copyText(IndexVersion *v, unsigned char *dst, PosType pos, PosType len)
+{
+  PosType baseLength = v->base->hdr->textLength;
+  while (len > 0) {
+    PosType n;
+    if (pos < baseLength) {
+      n = (len < baseLength - pos) ? len : baseLength - pos;
+      staticRead(v->base, dst, pos, n);
+    } else {
+      int i = 0;
+      while (i < v->ndeltas && !(v->deltas[i]->start <= pos && pos < v->deltas[i]->end)) i++;
+      assert(i < v->ndeltas, "Error: text position beyond the indexed text");
+      Delta *d = v->deltas[i];
+      n = (len < d->end - pos) ? len : d->end - pos;
+      memcpy(dst, d->seg + (pos - d->start), n);
+    }
+    dst += n; pos += n; len -= n;
+  }
+}
+
+// index the n bytes appended to the text: only the new windows are hashed,
+// and queries see them once the delta is built
+void appendText(unsigned char *bytes, PosType n)
+{
+  pthread_mutex_lock(&writerLock);
+  IndexVersion *v = copyVersion(atomic_load(&current));
+  int blockSize = v->base->hdr->blockSize, queryLen = 4 * blockSize, qgramSize = 2 * blockSize;
+  PosType oldEnd = indexedLength(v), end = oldEnd + n;
+  PosType start = (oldEnd >= queryLen) ? oldEnd - queryLen + 1 : 0;
+  PosType nwin = (end >= start + queryLen) ? end - start - queryLen + 1 : 0;
+  unsigned char key[qgramSize];
+
+  Delta *d = (Delta *) calloc(1, sizeof(Delta));
+  assert(d != 0, "malloc died in delta construction");
+  d->start = start;
+  d->end = end;
+  d->nbuckets = 6 * nwin / 4 + 1;
+  d->arena.chunkSize = (end - start) + d->nbuckets * sizeof(Dptr) + 6 * nwin * sizeof(Dnode) + 4 * ARENA_ALIGN;
+  d->arena.what = "delta index";
+  d->seg = (unsigned char *) arenaAlloc(&d->arena, end - start);
+  d->heads = (Dptr *) arenaAlloc(&d->arena, d->nbuckets * sizeof(Dptr));
+  memset(d->heads, 0, d->nbuckets * sizeof(Dptr));
+  copyText(v, d->seg, start, oldEnd - start);
+  memcpy(d->seg + (oldEnd - start), bytes, n);
+
+  for (PosType i = 0; i < nwin; i++)
+    for (int first = 0; first < 3; first++)
+      for (int second = first+1; second <= 3; second++) {
+	pairKey(key, d->seg, i, blockSize, first, second);
+	uint64_t b = hashKey(qgramSize, key) % d->nbuckets;
+	Dptr p = (Dptr) arenaAlloc(&d->arena, sizeof(Dnode));
+	p->pos = start + i;
+	p->sig = (uint32_t) hashBlock(qgramSize, key);
+	p->firstBlockPos = first;
+	p->secondBlockPos = second;
+	p->next = d->heads[b];
+	d->heads[b] = p;
+      }
+
+  statAdd(&stats.positions, nwin);
+  statAdd(&stats.entries, 6 * (uint64_t) nwin);
+  d->refs = 1;
+  memmove(v->deltas + 1, v->deltas, sizeof(Delta *) * v->ndeltas);
+  v->deltas[0] = d;
+  v->ndeltas++;
+  publishVersion(v);
+  pthread_mutex_unlock(&writerLock);
+}
+
+// Search of a pair block in a delta, as search() does
+PosType *deltaSearch(Delta *d, unsigned char *block, int len, int firstPiece, int secondPiece)
+{
+  uint64_t b = hashKey(len, block) % d->nbuckets;
+  uint32_t hb = (uint32_t) hashBlock(len, block);
+  int blockSize = len / 2, capacity = 16, j = 0;
+  PosType *results = (PosType *) arenaAlloc(&scratch, sizeof(PosType) * capacity);
+
+  for (Dptr p = d->heads[b]; p && !budgetTick(); p = p->next) {
+    unsigned char *q = d->seg + (p->pos - d->start);
+    if (p->sig == hb && p->firstBlockPos == firstPiece && p->secondBlockPos == secondPiece
+	&& memcmp(q + firstPiece * blockSize, block, blockSize) == 0
+	&& memcmp(q + secondPiece * blockSize, block + blockSize, blockSize) == 0
+	&& !isDeleted(p->pos)) {
+      if (budgetTake()) break;
+      if (j+1 == capacity) {
+	results = (PosType *) arenaGrow(&scratch, results, sizeof(PosType) * capacity, sizeof(PosType) * 2 * capacity);
+	capacity *= 2;
+      }
+      results[j++] = p->pos;
+    }
+  }
+  results[j] = -1;
+  return results;
+}
+
+// Search in the static index of v, or in its copy on the node of the thread, and in all its deltas
+PosType *lsmSearch(IndexVersion *v, unsigned char *block, int len, int firstPiece, int secondPiece)
+{
+  StaticIndex *x = v->base, local;
+  if (queryNode >= 0 && x->replica[queryNode] != NULL) {
+    local = *x;
+    attachStatic(&local, x->replica[queryNode]);
+    x = &local;
+  }
+  PosType *results = staticSearch(x, block, len, firstPiece, secondPiece);
+  if (v->ndeltas == 0) return results;
+
+  int j = 0;
+  while (results[j] != -1) j++;
+  for (int i = 0; i < v->ndeltas; i++) {
+    PosType *r = deltaSearch(v->deltas[i], block, len, firstPiece, secondPiece);
+    int n = 0;
+    while (r[n] != -1) n++;
+    PosType *all = (PosType *) arenaAlloc(&scratch, sizeof(PosType) * (j + n + 1));
+    memcpy(all, results, sizeof(PosType) * j);
+    memcpy(all + j, r, sizeof(PosType) * n);
+    results = all;
+    j += n;
+  }
+  results[j] = -1;
+  return results;
+}
+
+
+// Background compaction: one static index for a version and its deltas
+typedef struct {
+  pthread_t thread;
+  int running;
+  const char *saveTo;        // the compacted index replaces this file, if not NULL
+} Compaction;
+
+Compaction compaction;
+
+// the index file of the current version, and how many times it was reloaded (under writerLock)
+struct stat indexStat;
+uint64_t reloads = 0;
+
+void *compactionThread(void *arg)
+{
+  Compaction *c = (Compaction *) arg;
+  double start = spanBegin();
+  timelineName("compaction");
+
+  // build out of the version current at the start: it stays valid meanwhile
+  pthread_mutex_lock(&writerLock);
+  uint64_t generation = reloads;
+  IndexVersion *v = readBegin();
+  pthread_mutex_unlock(&writerLock);
+  PosType length = indexedLength(v);
+  int blockSize = v->base->hdr->blockSize;
+  Range *seen = (Range *) malloc(sizeof(Range) * (v->ntombs + 1));
+  int nseen = v->ntombs;
+  assert(seen != 0, "malloc died in compaction");
+  memcpy(seen, v->tombs, sizeof(Range) * nseen);
+
+  StaticIndex *x = (StaticIndex *) calloc(1, sizeof(StaticIndex));
+  unsigned char *text = (unsigned char *) malloc(length + 1);
+  assert(x != 0 && text != 0, "malloc died in compaction");
+  copyText(v, text, 0, length);
+  buildStatic(x, text, length, blockSize, v->base->hdr->textCodec, NULL);
+  free(text);
+  readEnd();
+  textCacheFree();
+  if (numaPolicy == NUMA_REPLICATE && numaNodes > 1) replicateStatic(x);
+
+  char tmp[4096];
+  if (c->saveTo != NULL) {
+    snprintf(tmp, sizeof(tmp), "%s.compacting", c->saveTo);
+    saveStatic(x, tmp);
+  }
+
+  // a reload meanwhile replaced the index compacted: the result is stale
+  pthread_mutex_lock(&writerLock);
+  if (reloads != generation) {
+    pthread_mutex_unlock(&writerLock);
+    fprintf(stderr, "  compaction dropped, the index was reloaded meanwhile\n");
+    if (c->saveTo != NULL) unlink(tmp);
+    destroyStatic(x);
+    free(x);
+    free(seen);
+    readerExit();
+    return NULL;
+  }
+  if (c->saveTo != NULL) {    // the old file stays valid for whoever has it mapped
+    assert(rename(tmp, c->saveTo) == 0, "Error: replacing the index file");
+    syncDirectory(c->saveTo);
+    stat(c->saveTo, &indexStat);
+  }
+
+  // publish: the deltas appended meanwhile stay, those compacted go
+  IndexVersion *n = copyVersion(atomic_load(&current));
+  releaseStatic(n->base);
+  x->refs = 1;
+  n->base = x;
+  int j = 0;
+  for (int i = 0; i < n->ndeltas; i++)
+    if (n->deltas[i]->end > length) n->deltas[j++] = n->deltas[i];
+    else releaseDelta(n->deltas[i]);
+  n->ndeltas = j;
+
+  // the compacted index has no entries in the tombstoned ranges it saw; ranges
+  // retracted while it was built are kept all until the next compaction
+  if (n->ntombs == nseen && memcmp(n->tombs, seen, sizeof(Range) * nseen) == 0)
+    dropTombstonesBelow(n, length - 4 * blockSize + 1);
+  free(seen);
+  if (c->saveTo != NULL) saveTombstones(n, c->saveTo);
+  publishVersion(n);
+  pthread_mutex_unlock(&writerLock);
+  spanEnd("compaction", start);
+  readerExit();
+  return NULL;
+}
+
+// wait for the running compaction, if any
+void finishCompaction()
+{
+  if (!compaction.running) return;
+  pthread_join(compaction.thread, NULL);
+  compaction.running = 0;
+}
+
+void startCompaction(const char *saveTo)
+{
+  finishCompaction();
+  compaction.saveTo = saveTo;
+  compaction.running = 1;
+  assert(pthread_create(&compaction.thread, NULL, compactionThread, &compaction) == 0,
+	 "Error: unable to start the compaction");
+}
+
+// index the bytes of fileName beyond the indexed text, which must be a prefix of
+// it; fileName is decoded if compressed, as the text of -f
+void appendFromFile(const char *fileName)
+{
+  Source in;
+  if (!sourceOpen(&in, fileName)) return;
+  IndexVersion *v = readBegin();
+  PosType length = in.length, indexed = indexedLength(v);
+  if (length <= indexed) { readEnd(); sourceClose(&in); return; }
+
+  // the end of the indexed text must be found in the file at the same place
+  PosType tail = (indexed < 4096) ? indexed : 4096;
+  unsigned char *buf = (unsigned char *) malloc((length - indexed > tail) ? length - indexed : tail);
+  assert(buf != 0, "malloc died in append");
+  unsigned char expected[tail > 0 ? tail : 1];
+  copyText(v, expected, indexed - tail, tail);
+  readEnd();
+  if (!sourceSkip(&in, indexed - tail) || sourceRead(&in, buf, tail) != (size_t) tail || memcmp(buf, expected, tail) != 0) {
+    if (in.error != NULL) fprintf(stderr, "\n  %s %s, appends ignored\n", in.error, fileName);
+    else fprintf(stderr, "\n  %s is not an extension of the indexed text, appends ignored\n", fileName);
+    free(buf);
+    sourceClose(&in);
+    return;
+  }
+  // a file corrupted or truncated past its tail adds nothing, the server goes on
+  if (sourceRead(&in, buf, length - indexed) != (size_t) (length - indexed)) {
+    fprintf(stderr, "\n  %s %s, appends ignored\n", (in.error != NULL) ? in.error : "Error: the text ended early in", fileName);
+    free(buf);
+    sourceClose(&in);
+    return;
+  }
+  sourceClose(&in);
+
+  appendText(buf, length - indexed);
+  fprintf(stderr, "\n  indexed %ld appended bytes of %s as a delta", (long) (length - indexed), fileName);
+  free(buf);
+}
+
+
+
+// ----- HOT RELOAD OF THE INDEX FILE -----
+//
+// A server mapping an index file (-i) switches to a new index saved over
+// it, e.g. by a rebuild renaming its output onto the file: the new file is
+// mapped and warmed aside, then published as a version of its own (its
+// tombstones, none of the deltas of the old index). Queries running keep
+// the old index, which is unmapped once the last of them ends. The file
+// is polled, and SIGHUP or the "!reload" command force a reload.
+
+
+#define RELOAD_POLL_MS 200
+
+volatile sig_atomic_t reloadSignal = 0;
+volatile int reloadStop = 0;
+struct stat refusedStat;     // last file refused, not retried until it changes
+
+
+void onSighup(int sig)
+{
+  (void) sig;
+  reloadSignal = 1;
+}
+
+static int sameFile(struct stat *a, struct stat *b)
+{
+  return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size
+    && a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+// map fileName and make it the index of the queries starting from now on; 0 if
+// it is refused, or if it is not forced and the file is current meanwhile (a
+// compaction renamed it there, with the deltas appended since)
+int reloadIndex(const char *fileName, int force)
+{
+  double start = spanBegin();
+  struct stat st;
+  int fd = open(fileName, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "  reload of %s failed: unable to open it\n", fileName);
+    if (fd >= 0) close(fd);
+    return 0;
+  }
+
+  StaticIndex *x = (StaticIndex *) calloc(1, sizeof(StaticIndex));
+  assert(x != 0, "malloc died in reload");
+  const char *err = mapImage(x, fd);
+  if (err == NULL && (int) x->hdr->blockSize != indexBlockSize)
+    err = "the index answers queries of another length";
+  else if (err == NULL && x->hdr->hashSeed != hashSeed)
+    err = "the index was built with another hash seed";
+  if (err != NULL) {
+    fprintf(stderr, "  reload of %s refused: %s\n", fileName, err);
+    if (x->image != NULL) destroyStatic(x);
+    free(x);
+    close(fd);
+    refusedStat = st;
+    return 0;
+  }
+  if (tierBudget > 0) tierStatic(x, fd);
+  else warmStatic(x);
+  close(fd);
+  if (numaPolicy == NUMA_REPLICATE && numaNodes > 1) replicateStatic(x);
+
+  pthread_mutex_lock(&writerLock);
+  if (!force && sameFile(&st, &indexStat)) {
+    pthread_mutex_unlock(&writerLock);
+    destroyStatic(x);
+    free(x);
+    return 0;
+  }
+  IndexVersion *v = copyVersion(NULL);   // the appends of the old index do not apply
+  x->refs = 1;
+  v->base = x;
+  loadTombstones(v, fileName);
+  indexStat = st;
+  reloads++;
+  publishVersion(v);
+  pthread_mutex_unlock(&writerLock);
+  fprintf(stderr, "  reloaded %s: %llu bytes of text\n", fileName, (unsigned long long) x->hdr->textLength);
+  spanEnd("reload", start);
+  return 1;
+}
+
+void *reloadThread(void *arg)
+{
+  const char *fileName = (const char *) arg;
+  struct timespec poll = {0, RELOAD_POLL_MS * 1000000L};
+  while (!reloadStop) {
+    nanosleep(&poll, NULL);
+    // a compaction renames its file and records it under the lock: not a change
+    struct stat st;
+    pthread_mutex_lock(&writerLock);
+    int changed = stat(fileName, &st) == 0 && !sameFile(&st, &refusedStat) && !sameFile(&st, &indexStat);
+    pthread_mutex_unlock(&writerLock);
+    if (changed || reloadSignal) {
+      int forced = reloadSignal;
+      reloadSignal = 0;
+      reloadIndex(fileName, forced);
+    }
+  }
+  return NULL;
+}
+
+
+
+// ----- SUFFIX SORTING AND SUFFIX ARRAY BACKEND -----
+//
+// The suffix array is built with SA-IS (induced sorting, linear time) and
+// stored with 4 bytes per entry (5 bytes for texts of 4GB or more), plus one
+// byte of LCP per entry. A piece is searched as an SA interval: a binary
+// search (skipping the bytes already matched at both ends) finds its first
+// row, the LCP array extends the interval without comparing the text again.
+// Neither the SA nor the FM-index depend on the query length.
+
+
+#define EMPTY_SLOT (-1)
+
+// bucket starts (end=0) or ends (end=1) of the symbols of s[0..n-1] over [0,K)
+static void getBuckets(const PosType *s, PosType n, PosType K, PosType *bkt, int end)
+{
+  PosType sum = 0;
+  for (PosType c = 0; c < K; c++) bkt[c] = 0;
+  for (PosType i = 0; i < n; i++) bkt[s[i]]++;
+  for (PosType c = 0; c < K; c++) {
+    sum += bkt[c];
+    bkt[c] = end ? sum : sum - bkt[c];
+  }
+}
+
+// induce L-type suffixes left-to-right, then S-type suffixes right-to-left
+static void induceSA(const PosType *s, PosType *sa, const unsigned char *t, PosType n, PosType K, PosType *bkt)
+{
+  getBuckets(s, n, K, bkt, 0);
+  for (PosType i = 0; i < n; i++) {
+    PosType j = sa[i] - 1;
+    if (sa[i] > 0 && !t[j]) sa[bkt[s[j]]++] = j;
+  }
+  getBuckets(s, n, K, bkt, 1);
+  for (PosType i = n-1; i >= 0; i--) {
+    PosType j = sa[i] - 1;
+    if (sa[i] > 0 && t[j]) sa[--bkt[s[j]]] = j;
+  }
+}
+
+#define isLMS(i) ((i) > 0 && t[i] && !t[(i)-1])
+
+// SA-IS: s[0..n-1] over [0,K) must end with the unique smallest symbol 0
+static void sais(const PosType *s, PosType *sa, PosType n, PosType K)
+{
+  unsigned char *t = (unsigned char *) malloc(n);   // 1 = S-type, 0 = L-type
+  PosType *bkt = (PosType *) malloc(sizeof(PosType) * K);
+  assert(t && bkt, "malloc died in suffix sorting");
+
+  t[n-1] = 1;
+  for (PosType i = n-2; i >= 0; i--)
+    t[i] = (s[i] < s[i+1] || (s[i] == s[i+1] && t[i+1]));
+
+  // sort the LMS substrings
+  getBuckets(s, n, K, bkt, 1);
+  for (PosType i = 0; i < n; i++) sa[i] = EMPTY_SLOT;
+  for (PosType i = 1; i < n; i++)
+    if (isLMS(i)) sa[--bkt[s[i]]] = i;
+  induceSA(s, sa, t, n, K, bkt);
+
+  // name them, equal substrings get equal names
+  PosType n1 = 0, name = 0, prev = -1;
+  for (PosType i = 0; i < n; i++)
+    if (isLMS(sa[i])) sa[n1++] = sa[i];
+  for (PosType i = n1; i < n; i++) sa[i] = EMPTY_SLOT;
+  for (PosType i = 0; i < n1; i++) {
+    PosType pos = sa[i];
+    int diff = 0;
+    for (PosType d = 0; ; d++) {
+      if (prev == -1 || s[pos+d] != s[prev+d] || t[pos+d] != t[prev+d]) { diff = 1; break; }
+      if (d > 0 && (isLMS(pos+d) || isLMS(prev+d))) break;
+    }
+    if (diff) { name++; prev = pos; }
+    sa[n1 + pos/2] = name - 1;
+  }
+  for (PosType i = n-1, j = n-1; i >= n1; i--)
+    if (sa[i] >= 0) sa[j--] = sa[i];
+
+  // sort the reduced string, recursively if names are not unique
+  PosType *s1 = sa + n - n1, *sa1 = sa;
+  if (name < n1) sais(s1, sa1, n1, name);
+  else for (PosType i = 0; i < n1; i++) sa1[s1[i]] = i;
+
+  // induce the whole SA from the sorted LMS suffixes
+  getBuckets(s, n, K, bkt, 1);
+  for (PosType i = 1, j = 0; i < n; i++)
+    if (isLMS(i)) s1[j++] = i;
+  for (PosType i = 0; i < n1; i++) sa1[i] = s1[sa1[i]];
+  for (PosType i = n1; i < n; i++) sa[i] = EMPTY_SLOT;
+  for (PosType i = n1-1; i >= 0; i--) {
+    PosType j = sa[i];
+    sa[i] = EMPTY_SLOT;
+    sa[--bkt[s[j]]] = j;
+  }
+  induceSA(s, sa, t, n, K, bkt);
+
+  free(bkt);
+  free(t);
+}
+
+// Suffix array of text[0..n-1], the empty suffix excluded
+PosType *buildSuffixArray(unsigned char *text, PosType n)
+{
+  PosType *s = (PosType *) malloc(sizeof(PosType) * (n+1));
+  PosType *sa = (PosType *) malloc(sizeof(PosType) * (n+1));
+  assert(s && sa, "malloc died in suffix sorting");
+
+  for (PosType i = 0; i < n; i++) s[i] = (PosType) text[i] + 1;
+  s[n] = 0;                                  // sentinel
+  sais(s, sa, n+1, 257);
+  free(s);
+  memmove(sa, sa+1, sizeof(PosType) * n);    // sa[0] was the sentinel
+  return sa;
+}
+
+
+// Starting positions of the query at which both pieces of a pair occur:
+// occ[t] holds the occurrences of piece t, already shifted back by the
+// offset of the piece in the query. The lists are sorted in place;
+// it returns an array of results ended by -1, as search() does.
+PosType *combinePieces(PosType *occ[2], PosType cnt[2])
+{
+  PosType *results = (PosType *) arenaAlloc(&scratch, sizeof(PosType) * ((cnt[0] < cnt[1] ? cnt[0] : cnt[1]) + 1));
+  int j = 0;
+
+  qsort(occ[0], cnt[0], sizeof(PosType), &int_cmp);
+  qsort(occ[1], cnt[1], sizeof(PosType), &int_cmp);
+  for (PosType a = 0, b = 0; a < cnt[0] && b < cnt[1]; ) {
+    if (occ[0][a] < occ[1][b]) a++;
+    else if (occ[0][a] > occ[1][b]) b++;
+    else { results[j++] = occ[0][a]; a++; b++; }
+  }
+  results[j] = -1;
+  return results;
+}
+
+
+typedef struct {
+  PosType n;                  // number of suffixes = oldTextLength
+  int width;                  // bytes per SA entry (little endian)
+  unsigned char *sa;
+  unsigned char *lcp;         // lcp[i] = LCP of rows i-1 and i, clipped at 255
+} SAindex;
+
+SAindex sax;
+
+
+PosType saGet(PosType i)
+{
+  uint64_t v = 0;
+  memcpy(&v, sax.sa + i * sax.width, sax.width);
+  return (PosType) v;
+}
+
+void buildSA(unsigned char *text, PosType len)
+{
+  statAdd(&stats.positions, len);
+  PosType *sa = buildSuffixArray(text, len);
+  PosType *rank = (PosType *) malloc(sizeof(PosType) * (len+1));
+
+  sax.n = len;
+  sax.width = (len < ((PosType) 1 << 32)) ? 4 : 5;
+  sax.sa = (unsigned char *) indexAlloc(len * sax.width + 8, "suffix array");
+  sax.lcp = (unsigned char *) indexAlloc(len + 1, "lcp");
+  assert(rank && sax.sa && sax.lcp, "malloc died in suffix array construction");
+
+  for (PosType i = 0; i < len; i++) {
+    uint64_t v = (uint64_t) sa[i];
+    memcpy(sax.sa + i * sax.width, &v, sax.width);
+    rank[sa[i]] = i;
+  }
+
+  // Kasai et al.: LCPs in text order, h decreases by at most one per step
+  PosType h = 0;
+  for (PosType p = 0; p < len; p++) {
+    PosType r = rank[p];
+    if (r == 0) { sax.lcp[0] = 0; h = 0; continue; }
+    PosType q = sa[r-1];
+    while (p + h < len && q + h < len && text[p+h] == text[q+h]) h++;
+    sax.lcp[r] = (h < 255) ? (unsigned char) h : 255;
+    if (h > 0) h--;
+  }
+  free(rank);
+  free(sa);
+
+  size_t bytes = len * (sax.width + 1);
+  fprintf(stderr, " suffix array: %zu bytes (%.2f per text byte)", bytes, (double) bytes / (len ? len : 1));
+}
+
+void destroySA()
+{
+  indexFree(sax.sa);
+  indexFree(sax.lcp);
+  memset(&sax, 0, sizeof(sax));
+}
+
+// rows [*sp,*ep) prefixed by piece[0..len-1]; returns their number
+PosType saSearch(unsigned char *piece, int len, PosType *sp, PosType *ep)
+{
+  PosType lo = 0, hi = sax.n;
+  int llo = 0, lhi = 0;       // bytes matched by the suffixes of rows lo-1 and hi
+
+  while (lo < hi) {
+    PosType mid = lo + (hi - lo) / 2, p = saGet(mid);
+    int l = (llo < lhi) ? llo : lhi;
+    while (l < len && p + l < oldTextLength && oldText[p+l] == piece[l]) l++;
+    if (l == len || (p + l < oldTextLength && oldText[p+l] > piece[l])) { hi = mid; lhi = l; }
+    else { lo = mid + 1; llo = l; }
+  }
+  *sp = *ep = lo;
+  if (lo == sax.n) return 0;
+  PosType p = saGet(lo);
+  if (p + len > oldTextLength || memcmp(oldText + p, piece, len) != 0) return 0;
+
+  PosType e = lo + 1;
+  int cap = (len < 255) ? len : 255;
+  while (e < sax.n && sax.lcp[e] >= cap
+	 && (len <= 255 || memcmp(oldText + saGet(e), piece, len) == 0))
+    e++;
+  *ep = e;
+  return e - lo;
+}
+
+// Search the pair of pieces first,second of queryStr, as fmSearch() does
+PosType *saSearchPair(unsigned char *queryStr, int blockSize, int firstPiece, int secondPiece)
+{
+  int queryLen = 4 * blockSize;
+  int piece[2] = {firstPiece, secondPiece};
+  PosType sp[2], ep[2], cnt[2];
+  PosType *occ[2];
+
+  for (int t = 0; t < 2; t++)
+    cnt[t] = saSearch(queryStr + piece[t] * blockSize, blockSize, &sp[t], &ep[t]);
+  if (cnt[0] == 0 || cnt[1] == 0) cnt[0] = cnt[1] = 0;
+
+  for (int t = 0; t < 2; t++) {
+    occ[t] = (PosType *) arenaAlloc(&scratch, sizeof(PosType) * (cnt[t] + 1));
+    PosType m = 0;
+    for (PosType row = sp[t]; row < sp[t] + cnt[t] && !budgetTick(); row++) {
+      PosType start = saGet(row) - piece[t] * blockSize;
+      if (start >= 0 && start + queryLen <= oldTextLength && !isDeleted(start)) occ[t][m++] = start;
+    }
+    cnt[t] = m;
+  }
+  PosType *results = combinePieces(occ, cnt);
+  budgetClamp(results);
+  return results;
+}
+
+
+
+// ----- FM-INDEX BACKEND -----
+//
+// The pair of pieces is not a substring of the text, but each piece is:
+// so we backward-search the two pieces independently, locate their
+// occurrences through a sampled suffix array and keep the starting
+// positions at which both pieces occur at the right offset.
+// Space is about 1.6 bytes per text byte (BWT + rank counters + SA samples),
+// instead of six Hnodes plus six keys per text position.
+
+
+#define FM_SA_SAMPLE 32      // we keep SA[i] iff SA[i] is a multiple of this
+#define FM_BLOCK     256     // rank counters: 16-bit every FM_BLOCK rows ...
+#define FM_SUPER     65536   // ... and 64-bit every FM_SUPER rows
+
+typedef struct {
+  PosType n;                  // number of rows = oldTextLength + 1 (the terminator)
+  PosType primary;            // row whose BWT char is the terminator
+  int sigma;                  // number of distinct bytes in the text
+  int code[256];              // byte -> rank among the distinct bytes, -1 if absent
+  PosType C[257];             // C[code] = number of suffixes starting with a smaller char
+  unsigned char *bwt;         // n bytes, bwt[primary] is meaningless
+  uint64_t *superOcc;         // [n/FM_SUPER+1][sigma] occurrences before the superblock
+  uint16_t *blockOcc;         // [n/FM_BLOCK+1][sigma] occurrences from the superblock start
+  uint64_t *marked;           // bitvector over rows: 1 iff the row is sampled
+  uint64_t *markedRank;       // number of marked rows before each 64-bit word
+  PosType *saSample;          // SA values of the marked rows, in row order
+} FMindex;
+
+FMindex fm;
+
+
+// number of occurrences of byte c in bwt[0..i)
+PosType fmRank(int c, PosType i)
+{
+  int k = fm.code[c];
+  PosType b = i / FM_BLOCK;
+  PosType r = fm.superOcc[(i / FM_SUPER) * fm.sigma + k] + fm.blockOcc[b * fm.sigma + k];
+  for (PosType j = b * FM_BLOCK; j < i; j++)
+    r += (fm.bwt[j] == c);
+  if (fm.primary >= b * FM_BLOCK && fm.primary < i && fm.bwt[fm.primary] == c)
+    r--;                                                  // the terminator is not c
+  return r;
+}
+
+// LF-mapping: the row of the suffix starting one position before
+PosType fmLF(PosType row)
+{
+  int c = fm.bwt[row];
+  return fm.C[fm.code[c]] + fmRank(c, row);
+}
+
+int fmIsMarked(PosType row)
+{
+  return (fm.marked[row >> 6] >> (row & 63)) & 1;
+}
+
+// text position of the suffix in the given row
+PosType fmLocate(PosType row)
+{
+  PosType steps = 0;
+  while (!fmIsMarked(row)) {
+    row = fmLF(row);
+    steps++;
+  }
+  uint64_t w = fm.marked[row >> 6] & ((((uint64_t) 1) << (row & 63)) - 1);
+  return fm.saSample[fm.markedRank[row >> 6] + __builtin_popcountll(w)] + steps;
+}
+
+// rows [*sp,*ep) prefixed by piece[0..len-1]; returns their number
+PosType fmBackwardSearch(unsigned char *piece, int len, PosType *sp, PosType *ep)
+{
+  PosType s = 0, e = fm.n;
+  for (int i = len-1; i >= 0 && s < e; i--) {
+    int c = piece[i];
+    if (fm.code[c] < 0) return (*sp = *ep = 0);
+    s = fm.C[fm.code[c]] + fmRank(c, s);
+    e = fm.C[fm.code[c]] + fmRank(c, e);
+  }
+  *sp = s; *ep = e;
+  return (e > s) ? e - s : 0;
+}
+
+
+void buildFM(unsigned char *text, PosType len)
+{
+  statAdd(&stats.positions, len);
+  PosType n = len + 1;
+  PosType *sa = buildSuffixArray(text, len);
+
+  fm.n = n;
+  fm.sigma = 0;
+  PosType count[256] = {0};
+  for (PosType i = 0; i < len; i++) count[text[i]]++;
+  PosType acc = 1;                          // the terminator is the smallest suffix
+  for (int c = 0; c < 256; c++) {
+    fm.code[c] = -1;
+    if (count[c] == 0) continue;
+    fm.code[c] = fm.sigma;
+    fm.C[fm.sigma++] = acc;
+    acc += count[c];
+  }
+  int sigma = (fm.sigma > 0) ? fm.sigma : 1;
+
+  PosType nsuper = n / FM_SUPER + 1, nblock = n / FM_BLOCK + 1, nwords = n / 64 + 1;
+  fm.bwt = (unsigned char *) indexAlloc(n, "bwt");
+  fm.superOcc = (uint64_t *) indexAlloc(nsuper * sigma * sizeof(uint64_t), "fm superblocks");
+  fm.blockOcc = (uint16_t *) indexAlloc(nblock * sigma * sizeof(uint16_t), "fm blocks");
+  fm.marked = (uint64_t *) indexAlloc(nwords * sizeof(uint64_t), "fm sampled rows");
+  fm.markedRank = (uint64_t *) indexAlloc(nwords * sizeof(uint64_t), "fm sampled ranks");
+  fm.saSample = (PosType *) indexAlloc((len / FM_SA_SAMPLE + 2) * sizeof(PosType), "fm sa samples");
+  assert(fm.bwt && fm.superOcc && fm.blockOcc && fm.marked && fm.markedRank && fm.saSample,
+	 "malloc died in FM-index construction");
+
+  // row 0 is the terminator suffix, the other rows come from sa[]
+  PosType nsampled = 0;
+  uint64_t occ[256] = {0}, superBase[256] = {0};
+  for (PosType row = 0; row < n; row++) {
+    PosType p = (row == 0) ? len : sa[row-1];
+    if (row % FM_SUPER == 0)
+      for (int k = 0; k < fm.sigma; k++) {
+	superBase[k] = occ[k];
+	fm.superOcc[(row / FM_SUPER) * sigma + k] = occ[k];
+      }
+    if (row % FM_BLOCK == 0)
+      for (int k = 0; k < fm.sigma; k++)
+	fm.blockOcc[(row / FM_BLOCK) * sigma + k] = (uint16_t) (occ[k] - superBase[k]);
+    if (p == 0) {
+      fm.primary = row;
+      fm.bwt[row] = 0;
+    } else {
+      fm.bwt[row] = text[p-1];
+      occ[fm.code[text[p-1]]]++;
+    }
+    if (p % FM_SA_SAMPLE == 0 || p == len) {
+      fm.marked[row >> 6] |= ((uint64_t) 1) << (row & 63);
+      fm.saSample[nsampled++] = p;
+    }
+  }
+  for (PosType w = 0, r = 0; w < nwords; w++) {
+    fm.markedRank[w] = (uint64_t) r;
+    r += __builtin_popcountll(fm.marked[w]);
+  }
+  free(sa);
+
+  size_t bytes = n + nsuper * sigma * sizeof(uint64_t) + nblock * sigma * sizeof(uint16_t)
+    + nwords * 2 * sizeof(uint64_t) + nsampled * sizeof(PosType);
+  fprintf(stderr, " FM-index: %zu bytes (%.2f per text byte)", bytes, (double) bytes / (len ? len : 1));
+}
+
+void destroyFM()
+{
+  indexFree(fm.bwt);
+  indexFree(fm.superOcc);
+  indexFree(fm.blockOcc);
+  indexFree(fm.marked);
+  indexFree(fm.markedRank);
+  indexFree(fm.saSample);
+  memset(&fm, 0, sizeof(fm));
+}
+
+
+// Search the pair of pieces first,second of queryStr (pieces have length blockSize)
+// it returns an array of starting positions ended by -1, as search() does
+PosType *fmSearch(unsigned char *queryStr, int blockSize, int firstPiece, int secondPiece)
+{
+  int queryLen = 4 * blockSize;
+  int piece[2] = {firstPiece, secondPiece};
+  PosType sp[2], ep[2], cnt[2];
+  PosType *occ[2];
+
+  for (int t = 0; t < 2; t++)
+    cnt[t] = fmBackwardSearch(queryStr + piece[t] * blockSize, blockSize, &sp[t], &ep[t]);
+  if (cnt[0] == 0 || cnt[1] == 0) cnt[0] = cnt[1] = 0;
+
+  // shift every occurrence back to the starting position of the query
+  for (int t = 0; t < 2; t++) {
+    occ[t] = (PosType *) arenaAlloc(&scratch, sizeof(PosType) * (cnt[t] + 1));
+    PosType m = 0;
+    for (PosType row = sp[t]; row < sp[t] + cnt[t] && !budgetTick(); row++) {
+      PosType start = fmLocate(row) - piece[t] * blockSize;
+      if (start >= 0 && start + queryLen <= oldTextLength && !isDeleted(start)) occ[t][m++] = start;
+    }
+    cnt[t] = m;
+  }
+  PosType *results = combinePieces(occ, cnt);
+  budgetClamp(results);
+  return results;
+}
+
+
+// ----- CACHE OF QUERY RESULTS -----
+//
+// With -R the answers of the queries are kept in a cache bounded in bytes,
+// in front of the searches: a query asked again gets its positions without
+// any lookup. The key is the query with the number of mismatches verified
+// and the backend, and an answer is valid only for the version it was
+// computed on: once a reload, an append, a retraction or a compaction
+// publishes another version, the old answers are never returned again and
+// are evicted, least recently used first, as new ones come in. The cache
+// is split in shards by the hash of the key, each with its own lock.
+
+
+#define RESULT_SHARDS 16
+#define RESULT_SLOT   256      // bytes of cache per slot of the hash table of a shard
+
+typedef struct cachedResult {
+  uint64_t hash;
+  uint64_t epoch;            // of the version answering
+  int k, mode, len, n;
+  unsigned char *query;      // len bytes, after the positions
+  PosType *pos;              // n positions, after the entry
+  size_t size;
+  struct cachedResult *newer, *older;  // LRU order
+  struct cachedResult *chain;          // same slot of the shard
+} CachedResult;
+
+typedef struct {
+  pthread_mutex_t lock;
+  CachedResult **slots;
+  uint64_t nslots;
+  CachedResult *newest, *oldest;
+  size_t bytes;
+  uint64_t hits, misses, stale;
+} ResultShard;
+
+ResultShard resultCache[RESULT_SHARDS];
+size_t resultBudget = 0;     // -R: bytes of the cache, 0 if there is none
+
+
+void initResultCache()
+{
+  for (int s = 0; s < RESULT_SHARDS; s++) {
+    ResultShard *c = &resultCache[s];
+    pthread_mutex_init(&c->lock, NULL);
+    c->nslots = resultBudget / RESULT_SHARDS / RESULT_SLOT + 1;
+    c->slots = (CachedResult **) calloc(c->nslots, sizeof(CachedResult *));
+    assert(c->slots != 0, "malloc died in the result cache");
+  }
+}
+
+static uint64_t resultHash(unsigned char *query, int len, int k, int mode)
+{
+  return (textChecksum(query, len) ^ ((uint64_t) (k + 1) << 8 | mode)) * 1099511628211ULL;
+}
+
+// unlink e from the LRU order and the slot of its shard c
+static void dropResult(ResultShard *c, CachedResult *e)
+{
+  CachedResult **p = &c->slots[(e->hash / RESULT_SHARDS) % c->nslots];
+  while (*p != e) p = &(*p)->chain;
+  *p = e->chain;
+  if (e->newer) e->newer->older = e->older;
+  else c->newest = e->older;
+  if (e->older) e->older->newer = e->newer;
+  else c->oldest = e->newer;
+  c->bytes -= e->size;
+}
+
+static void pushResult(ResultShard *c, CachedResult *e)
+{
+  CachedResult **slot = &c->slots[(e->hash / RESULT_SHARDS) % c->nslots];
+  e->chain = *slot;
+  *slot = e;
+  e->newer = NULL;
+  e->older = c->newest;
+  if (c->newest) c->newest->newer = e;
+  else c->oldest = e;
+  c->newest = e;
+  c->bytes += e->size;
+}
+
+static CachedResult *findResult(ResultShard *c, uint64_t hash, unsigned char *query, int len, int k, int mode)
+{
+  CachedResult *e = c->slots[(hash / RESULT_SHARDS) % c->nslots];
+  while (e != NULL && !(e->hash == hash && e->len == len && e->k == k && e->mode == mode
+			&& memcmp(e->query, query, len) == 0))
+    e = e->chain;
+  return e;
+}
+
+// 1 iff the answer of query on the version published at epoch is cached: its
+// positions are copied in *results (scratch memory), and their number in *n
+int cachedResults(uint64_t epoch, unsigned char *query, int len, int k, int mode, PosType **results, int *n)
+{
+  uint64_t hash = resultHash(query, len, k, mode);
+  ResultShard *c = &resultCache[hash % RESULT_SHARDS];
+  pthread_mutex_lock(&c->lock);
+  CachedResult *e = findResult(c, hash, query, len, k, mode);
+  if (e != NULL && e->epoch != epoch) {   // computed on another version
+    dropResult(c, e);
+    free(e);
+    c->stale++;
+    pthread_mutex_unlock(&c->lock);
+    return 0;
+  }
+  if (e == NULL) {
+    c->misses++;
+    pthread_mutex_unlock(&c->lock);
+    return 0;
+  }
+  c->hits++;
+  dropResult(c, e);          // most recently used now
+  pushResult(c, e);
+  *n = e->n;
+  *results = (PosType *) arenaAlloc(&scratch, sizeof(PosType) * (e->n + 1));
+  memcpy(*results, e->pos, sizeof(PosType) * e->n);
+  pthread_mutex_unlock(&c->lock);
+  return 1;
+}
+
+// keep the n positions r answering query on the version published at epoch
+void cacheResults(uint64_t epoch, unsigned char *query, int len, int k, int mode, PosType *r, int n)
+{
+  uint64_t hash = resultHash(query, len, k, mode);
+  ResultShard *c = &resultCache[hash % RESULT_SHARDS];
+  size_t size = sizeof(CachedResult) + sizeof(PosType) * n + len;
+  if (size > resultBudget / RESULT_SHARDS) return;
+
+  CachedResult *e = (CachedResult *) malloc(size);
+  assert(e != 0, "malloc died in the result cache");
+  e->hash = hash;
+  e->epoch = epoch;
+  e->k = k;
+  e->mode = mode;
+  e->len = len;
+  e->n = n;
+  e->size = size;
+  e->pos = (PosType *) (e + 1);
+  e->query = (unsigned char *) (e->pos + n);
+  memcpy(e->pos, r, sizeof(PosType) * n);
+  memcpy(e->query, query, len);
+
+  pthread_mutex_lock(&c->lock);
+  CachedResult *old = findResult(c, hash, query, len, k, mode);
+  if (old != NULL) {         // answered meanwhile by another thread, or stale
+    dropResult(c, old);
+    free(old);
+  }
+  while (c->bytes + size > resultBudget / RESULT_SHARDS) {
+    CachedResult *lru = c->oldest;
+    dropResult(c, lru);
+    free(lru);
+  }
+  pushResult(c, e);
+  pthread_mutex_unlock(&c->lock);
+}
+
+void destroyResultCache()
+{
+  uint64_t hits = 0, misses = 0, stale = 0, entries = 0;
+  size_t bytes = 0;
+  for (int s = 0; s < RESULT_SHARDS; s++) {
+    ResultShard *c = &resultCache[s];
+    for (CachedResult *e = c->newest, *next; e != NULL; e = next) {
+      next = e->older;
+      free(e);
+      entries++;
+    }
+    bytes += c->bytes;
+    hits += c->hits;
+    misses += c->misses;
+    stale += c->stale;
+    free(c->slots);
+    pthread_mutex_destroy(&c->lock);
+  }
+  memset(resultCache, 0, sizeof(resultCache));
+  fprintf(stderr, "\n result cache: %llu hits, %llu misses (%llu of an older version), %llu answers in %zu bytes\n",
+	  (unsigned long long) hits, (unsigned long long) misses + stale, (unsigned long long) stale,
+	  (unsigned long long) entries, bytes);
+}
+
+
+
+// ----- EXPLAINED QUERIES -----
+//
+// With -E every query answered also writes a line of JSON telling how it
+// was answered: the backend and the plan (alone, in a batch of queries, or
+// from the cache of -R), and for each of its six pairs the key searched,
+// the bucket it falls in and the length of the chain there (for fm and sa,
+// which have no buckets, the occurrences of its two pieces), the candidates
+// it gave, how many queries of the batch shared its search and the time of
+// the search; then the candidates, the duplicates, the outcome of the
+// verification of -k and the time of each stage. Explaining walks each
+// chain once more: it is meant to tune the block size and to spot heavy
+// keys, not to run all the time.
+
+
+typedef struct {
+  unsigned char *key;        // the two pieces, one after the other (scratch memory)
+  int first, second, blockSize;
+  int64_t bucket;            // -1 for fm and sa
+  uint64_t chain;            // entries of the bucket, or occurrences of the pieces (fm, sa)
+  uint64_t candidates;       // taken by the query
+  int shared;                // queries of the batch searching this pair
+  double us;
+} ExplainedPair;
+
+typedef struct {
+  const char *plan;          // "single", "batch" or "cache"
+  int batch;                 // queries answered together
+  int npairs;
+  ExplainedPair pair[6];
+  uint64_t candidates, distinct, answered;
+  double start, lookupUs, verifyUs;
+  int truncated;
+} Explain;
+
+FILE *explainFile = NULL;    // -E
+__thread Explain *queryExplain = NULL;   // of the query the thread is answering, if explained
+
+void explainStart(Explain *e, const char *plan, int batch)
+{
+  memset(e, 0, sizeof(Explain));
+  e->plan = plan;
+  e->batch = batch;
+  e->start = nowUs();
+}
+
+// a pair searched for the query of e, on the version v: found candidates taken in us
+void explainPair(Explain *e, IndexVersion *v, unsigned char *queryStr, unsigned char *key, int blockSize,
+		 int first, int second, uint64_t found, double us, int shared)
+{
+  ExplainedPair *p = &e->pair[e->npairs++];
+  int len = 2 * blockSize;
+  p->key = key;
+  p->first = first;
+  p->second = second;
+  p->blockSize = blockSize;
+  p->candidates = found;
+  p->shared = shared;
+  p->us = us;
+  p->chain = 0;
+  e->lookupUs += us;
+  if (backend == BACKEND_HTAB) {
+    p->bucket = hashTable(len, key);
+    for (Hptr h = htab[p->bucket]; h; h = h->next) p->chain++;
+  } else if (backend == BACKEND_STATIC) {
+    StaticIndex *x = v->base;
+    p->bucket = hashKey(len, key) % x->hdr->nbuckets;
+    p->chain = x->buckets[p->bucket+1] - x->buckets[p->bucket];
+  } else {
+    PosType sp, ep;
+    p->bucket = -1;
+    p->chain += (backend == BACKEND_FM) ? fmBackwardSearch(queryStr + first * blockSize, blockSize, &sp, &ep)
+      : saSearch(queryStr + first * blockSize, blockSize, &sp, &ep);
+    p->chain += (backend == BACKEND_FM) ? fmBackwardSearch(queryStr + second * blockSize, blockSize, &sp, &ep)
+      : saSearch(queryStr + second * blockSize, blockSize, &sp, &ep);
+  }
+}
+
+// bytes as a JSON string
+static void jsonString(FILE *f, unsigned char *s, int len)
+{
+  fputc('"', f);
+  for (int i = 0; i < len; i++)
+    if (s[i] == '"' || s[i] == '\\') fprintf(f, "\\%c", s[i]);
+    else if (s[i] < 32 || s[i] >= 127) fprintf(f, "\\u%04x", s[i]);
+    else fputc(s[i], f);
+  fputc('"', f);
+}
+
+// the line of the query q explained by e
+void explainQuery(Explain *e, unsigned char *q, int len)
+{
+  const char *name[] = {"htab", "fm", "sa", "static"};
+  FILE *f = explainFile;
+  flockfile(f);
+  fprintf(f, "{\"query\": ");
+  jsonString(f, q, len);
+  fprintf(f, ", \"backend\": \"%s\", \"plan\": \"%s\", \"batch\": %d, \"k\": %d, \"pairs\": [",
+	  name[backend], e->plan, e->batch, maxMismatches);
+  for (int i = 0; i < e->npairs; i++) {
+    ExplainedPair *p = &e->pair[i];
+    fprintf(f, "%s{\"pieces\": [%d, %d], \"key\": ", i ? ", " : "", p->first, p->second);
+    jsonString(f, p->key, 2 * p->blockSize);
+    if (p->bucket >= 0) fprintf(f, ", \"bucket\": %lld, \"chain\": %llu", (long long) p->bucket, (unsigned long long) p->chain);
+    else fprintf(f, ", \"occurrences\": %llu", (unsigned long long) p->chain);
+    fprintf(f, ", \"candidates\": %llu, \"shared\": %d, \"us\": %.1f}", (unsigned long long) p->candidates, p->shared, p->us);
+  }
+  fprintf(f, "], \"candidates\": %llu, \"duplicates\": %llu, \"rejected\": %llu, \"answered\": %llu, \"truncated\": %s",
+	  (unsigned long long) e->candidates, (unsigned long long) (e->candidates - e->distinct),
+	  (unsigned long long) (e->distinct - e->answered), (unsigned long long) e->answered, e->truncated ? "true" : "false");
+  fprintf(f, ", \"us\": {\"lookup\": %.1f, \"verify\": %.1f, \"total\": %.1f}}\n",
+	  e->lookupUs, e->verifyUs, nowUs() - e->start);
+  fflush(f);
+  funlockfile(f);
+}
+
+
+
+// ----- MAIN PROCEDURE -----
+
+
+// keep the candidates r[0..n) whose window is within k mismatches of queryStr:
+// the text is read from the version v (static backend) or oldText, and only
+// the blocks holding the candidates are decoded if it is compressed
+int verifyCandidates(IndexVersion *v, unsigned char *queryStr, int queryLen, PosType *r, int n, int k)
+{
+  PosType length = (backend == BACKEND_STATIC) ? indexedLength(v) : oldTextLength;
+  unsigned char *window = (unsigned char *) arenaAlloc(&scratch, queryLen);
+  int j = 0;
+  for (int i = 0; i < n && !budgetTick(); i++) {
+    if (r[i] + queryLen > length) continue;   // pieces found at the end of the text
+    unsigned char *w = oldText + r[i];
+    if (backend == BACKEND_STATIC) {
+      copyText(v, window, r[i], queryLen);
+      w = window;
+    }
+    int d = 0;
+    for (int l = 0; l < queryLen && d <= k; l++)
+      d += (w[l] != queryStr[l]);
+    if (d <= k) r[j++] = r[i];
+  }
+  return j;
+}
+
+// the queries of this length cannot be answered by the index
+static int wrongLength(int queryLen)
+{
+  return queryLen == 0 || queryLen % 4 != 0
+    || ((backend == BACKEND_HTAB || backend == BACKEND_STATIC) && queryLen / 4 != indexBlockSize);
+}
+
+// exact search of the pieces first and second of queryStr (blockTmp holds them one
+// after the other) on the version v: positions in scratch memory, ended by -1
+static PosType *searchPair(IndexVersion *v, unsigned char *queryStr, unsigned char *blockTmp, int blockSize, int first, int second)
+{
+  double start = nowUs();
+  PosType *found;
+  if (backend == BACKEND_FM)
+    found = fmSearch(queryStr,blockSize,first,second);
+  else if (backend == BACKEND_SA)
+    found = saSearchPair(queryStr,blockSize,first,second);
+  else if (backend == BACKEND_STATIC)
+    found = lsmSearch(v,blockTmp,2*blockSize,first,second);
+  else
+    found = search(blockTmp,2*blockSize,first,second);
+  statPhase(PHASE_LOOKUP, start);
+
+  uint64_t n = 0;
+  while (found[n] != -1) n++;
+  statAdd(&stats.pairs, 1);
+  statAdd(&stats.candidates, n);
+  statAdd(&stats.pairCandidates[statBin(n)], 1);
+  return found;
+}
+
+// the rSize positions r found for the pairs of queryStr on the version v (published
+// at epoch) are sorted and deduplicated, verified (-k) and cached (-R, unless the
+// budget of the thread truncated the query): how many are left
+static int finishQuery(IndexVersion *v, uint64_t epoch, unsigned char *queryStr, int queryLen, PosType *r, int rSize)
+{
+  qsort(r, rSize, sizeof(PosType), &int_cmp);
+  int distinct = removeDuplicates(r, rSize);
+  statAdd(&stats.duplicates, rSize - distinct);
+  Explain *e = queryExplain;
+  if (e != NULL) {
+    e->candidates = rSize;
+    e->distinct = distinct;
+  }
+  rSize = distinct;
+  if (maxMismatches >= 0) {
+    double start = nowUs();
+    rSize = verifyCandidates(v, queryStr, queryLen, r, distinct, maxMismatches);
+    statPhase(PHASE_VERIFY, start);
+    statAdd(&stats.verified, distinct);
+    statAdd(&stats.rejected, distinct - rSize);
+    if (e != NULL) e->verifyUs = nowUs() - start;
+  }
+  int truncated = (queryBudget != NULL && queryBudget->truncated);
+  if (e != NULL) {
+    e->answered = rSize;
+    e->truncated = truncated;
+  }
+  if (truncated) statAdd(&stats.truncated, 1);
+  else if (resultBudget > 0) cacheResults(epoch, queryStr, queryLen, maxMismatches, backend, r, rSize);
+  return rSize;
+}
+
+// Search queryStr of length queryLen on the version current when the search
+// starts, verbose traces the pairs searched: the positions are left sorted in
+// *results (scratch memory), and their number is returned (-1 if the index
+// cannot answer queries of that length). They are the candidates of the
+// pairs, or those within maxMismatches of queryStr if it is set (-k); with
+// -R they come from the cache if the query was answered on the same version.
+// *truncated tells whether the bounds of -D and -L stopped the query
+int answerQuery(unsigned char *queryStr, int queryLen, PosType **results, int verbose, int *truncated)
+{
+  *truncated = 0;
+  statAdd(&stats.queries, 1);
+  if (wrongLength(queryLen)) return -1;
+  double started = spanBegin();
+  int blockSize = queryLen/4;  //We split the queryString in 4 blocks of equal length
+  int qgramSize = 2 * blockSize;
+
+  IndexVersion *v = readBegin();
+  uint64_t epoch = v ? v->epoch : 0;   // htab, fm and sa have a version only if retractions made one
+  PosType *r = NULL;
+  int rSize = 0;
+  PosType *r_tmp;
+
+  Explain ex;
+  if (explainFile != NULL) explainStart(&ex, "single", 1);
+  if (resultBudget > 0 && cachedResults(epoch, queryStr, queryLen, maxMismatches, backend, results, &rSize)) {
+    readEnd();
+    if (explainFile != NULL) {
+      ex.plan = "cache";
+      ex.answered = rSize;
+      explainQuery(&ex, queryStr, queryLen);
+    }
+    return rSize;
+  }
+  if (explainFile != NULL) queryExplain = &ex;
+  Budget budget;
+  budgetInit(&budget, nowUs(), NULL);
+  if (budgetBounded(&budget)) queryBudget = &budget;
+
+  for(int first=0; first < 3; first++){
+    for(int second = first+1; second <= 3; second++){
+      
+      //allocate memory and create the block to be searched exactly
+      unsigned char *blockTmp = (unsigned char *) arenaAlloc(&scratch, qgramSize+1);
       blockTmp[qgramSize] = 0;
       for(int l=0; l < blockSize; l++){
 	blockTmp[l] = queryStr[first * blockSize + l];
 	blockTmp[l+blockSize] = queryStr[second * blockSize + l];
       }
       
-      printBlock(blockTmp,qgramSize);
-      fprintf(stderr, "   searching.... ");
+      if (verbose && TRACING(TRACE_QUERY)) {
+	printBlock(blockTmp,qgramSize);
+	fprintf(stderr, "   searching.... ");
+      }
       
       // Compute results and add to the final set
-      r_tmp = search(blockTmp,qgramSize,first,second);
+      double start = (queryExplain != NULL) ? nowUs() : 0;
+      r_tmp = searchPair(v,queryStr,blockTmp,blockSize,first,second);
       
+      int n_tmp = 0;
+      while (r_tmp[n_tmp] != -1) n_tmp++;
+      if (queryExplain != NULL)
+	explainPair(&ex, v, queryStr, blockTmp, blockSize, first, second, n_tmp, nowUs() - start, 1);
+      r = (PosType *) arenaGrow(&scratch, r, rSize * sizeof(PosType), (rSize + n_tmp + 1) * sizeof(PosType));
       for(int j=0; r_tmp[j] != -1; j++){
 	  r[rSize++] = r_tmp[j];
 	  // fprintf(stderr,"%ld\n",r_tmp[j]);
       }
       
-      fprintf(stderr,"%d\n\n",rSize);
+      if (verbose) trace(TRACE_QUERY, "%d\n\n", rSize);
       
     } // end second
   } // end first
   
   // remove duplicates
-  heapsort(r, rSize, sizeof(PosType), &int_cmp);
-  rSize = removeDuplicates(r, rSize);
+  rSize = finishQuery(v, epoch, queryStr, queryLen, r, rSize);
+  if (queryExplain != NULL) explainQuery(&ex, queryStr, queryLen);
+  readEnd();
+  queryExplain = NULL;
+  queryBudget = NULL;
+  spanEnd("query", started);
+  *truncated = budget.truncated;
+  *results = r;
+  return rSize;
+}
+
+
+// A batch of queries is answered on one version, and the pairs of all its
+// queries are sorted by their key first: each distinct pair is searched
+// once, and its positions go to every query having it (queries built from
+// a template share most of their pieces).
+
+typedef struct {
+  unsigned char *key;        // the two pieces, one after the other
+  int blockSize, first, second;
+  int query;                 // of the batch
+  PosType *found;            // ended by -1
+  int nfound;                // taken by the query, within its budget
+} PairRef;
+
+_Atomic uint64_t pairsAsked = 0, pairsSearched = 0;   // by the batches
+
+static int pairref_cmp(const void *a, const void *b)
+{
+  const PairRef *x = (const PairRef *) a, *y = (const PairRef *) b;
+  if (x->blockSize != y->blockSize) return x->blockSize - y->blockSize;
+  if (x->first != y->first) return x->first - y->first;
+  if (x->second != y->second) return x->second - y->second;
+  return memcmp(x->key, y->key, 2 * x->blockSize);
+}
+
+// the budget of the search of the pair of refs[i..j), shared by their queries: those
+// already stopped get nfound -1, and among the others the budget is none if one of
+// them is not bounded, its own if there is one, the loosest of their bounds in group
+// otherwise (group is truncated if they are all stopped)
+static Budget *pairBudget(PairRef *refs, int i, int j, Budget *budgets, Budget *group)
+{
+  Budget *only = NULL;
+  int running = 0, unbounded = 0;
+  memset(group, 0, sizeof(Budget));
+  for (int l = i; l < j; l++) {
+    Budget *b = &budgets[refs[l].query];
+    if (budgetBounded(b) && (b->truncated || budgetCheck(b))) {
+      refs[l].nfound = -1;
+      continue;
+    }
+    if (!budgetBounded(b)) unbounded = 1;
+    else if (only == NULL) {
+      only = b;
+      group->deadline = b->deadline;
+      group->candidates = b->candidates;
+    } else {
+      if (group->deadline > 0 && (b->deadline == 0 || b->deadline > group->deadline)) group->deadline = b->deadline;
+      if (group->candidates >= 0 && (b->candidates < 0 || b->candidates > group->candidates)) group->candidates = b->candidates;
+    }
+    running++;
+  }
+  if (running == 0) group->truncated = 1;
+  else if (unbounded) return NULL;
+  else if (running == 1) return only;
+  return group;
+}
+
+// answer the n queries q[i] of length len[i] of a batch: count[i] gets the number
+// of positions in results[i] (scratch memory), or -1 as with answerQuery(); the
+// queries are bounded by budgets[i] (budgetInit()), if budgets is not NULL
+void answerBatch(unsigned char **q, int *len, int n, PosType **results, int *count, Budget *budgets)
+{
+  IndexVersion *v = readBegin();
+  uint64_t epoch = v ? v->epoch : 0;
+  PairRef *refs = (PairRef *) arenaAlloc(&scratch, sizeof(PairRef) * 6 * n + 1);
+  int *pending = (int *) arenaAlloc(&scratch, sizeof(int) * n);
+  int nrefs = 0;
+  statAdd(&stats.queries, n);
+  Explain *ex = (explainFile != NULL) ? (Explain *) arenaAlloc(&scratch, sizeof(Explain) * n) : NULL;
+
+  for (int i = 0; i < n; i++) {
+    pending[i] = 0;
+    if (ex != NULL) explainStart(&ex[i], "batch", n);
+    if (wrongLength(len[i])) count[i] = -1;
+    else if (resultBudget > 0 && cachedResults(epoch, q[i], len[i], maxMismatches, backend, &results[i], &count[i])) {
+      if (ex != NULL) {
+	ex[i].plan = "cache";
+	ex[i].answered = count[i];
+      }
+    } else {
+      int blockSize = len[i] / 4;
+      pending[i] = 1;
+      count[i] = 0;
+      for (int first = 0; first < 3; first++)
+	for (int second = first+1; second <= 3; second++) {
+	  PairRef *p = &refs[nrefs++];
+	  p->key = (unsigned char *) arenaAlloc(&scratch, 2 * blockSize);
+	  pairKey(p->key, q[i], 0, blockSize, first, second);
+	  p->blockSize = blockSize;
+	  p->first = first;
+	  p->second = second;
+	  p->query = i;
+	  p->nfound = 0;
+	}
+    }
+  }
+
+  // one search per distinct pair
+  double stage = spanBegin();
+  qsort(refs, nrefs, sizeof(PairRef), &pairref_cmp);
+  int searched = 0;
+  for (int i = 0, j; i < nrefs; i = j) {
+    PairRef *p = &refs[i];
+    for (j = i + 1; j < nrefs && pairref_cmp(p, &refs[j]) == 0; j++);
+    Budget group, *b = (budgets != NULL) ? pairBudget(refs, i, j, budgets, &group) : NULL;
+    PosType none = -1, *found = &none;
+    double start = nowUs();
+    if (b != &group || !group.truncated) {   // not all its queries are stopped
+      queryBudget = b;
+      found = searchPair(v, q[p->query], p->key, p->blockSize, p->first, p->second);
+      queryBudget = NULL;
+      searched++;
+    }
+    double us = nowUs() - start;
+    int nfound = 0;
+    while (found[nfound] != -1) nfound++;
+    for (int l = i; l < j; l++) {
+      Budget *c = (budgets != NULL) ? &budgets[refs[l].query] : NULL;
+      int taken = nfound;
+      if (refs[l].nfound < 0) taken = 0;   // stopped before the search
+      else if (c != NULL && c != b && budgetBounded(c)) {   // the search did not go through its budget
+	if (b == &group && group.truncated) c->truncated = 1;
+	if (c->candidates >= 0 && taken > c->candidates) {
+	  taken = c->candidates;
+	  c->truncated = 1;
+	}
+	if (c->candidates >= 0) c->candidates -= taken;
+      }
+      refs[l].found = found;
+      refs[l].nfound = taken;
+      count[refs[l].query] += taken;
+      if (ex != NULL)
+	explainPair(&ex[refs[l].query], v, q[refs[l].query], refs[l].key, p->blockSize, p->first, p->second, taken, us, j - i);
+    }
+  }
+  atomic_fetch_add(&pairsAsked, nrefs);
+  atomic_fetch_add(&pairsSearched, searched);
+  spanEnd("lookup", stage);
+  stage = spanBegin();
+
+  // the positions of its pairs to each query
+  for (int i = 0; i < n; i++)
+    if (pending[i]) {
+      results[i] = (PosType *) arenaAlloc(&scratch, sizeof(PosType) * (count[i] + 1));
+      count[i] = 0;
+    }
+  for (int i = 0; i < nrefs; i++) {
+    int k = refs[i].query;
+    memcpy(results[k] + count[k], refs[i].found, sizeof(PosType) * refs[i].nfound);
+    count[k] += refs[i].nfound;
+  }
+  spanEnd("merge", stage);
+  stage = spanBegin();
+  for (int i = 0; i < n; i++)
+    if (pending[i]) {
+      queryBudget = (budgets != NULL && budgetBounded(&budgets[i])) ? &budgets[i] : NULL;
+      queryExplain = (ex != NULL) ? &ex[i] : NULL;
+      count[i] = finishQuery(v, epoch, q[i], len[i], results[i], count[i]);
+    }
+  queryBudget = NULL;
+  queryExplain = NULL;
+  spanEnd("verify", stage);   // duplicates removed, -k, cache
+  if (ex != NULL)
+    for (int i = 0; i < n; i++)
+      if (count[i] >= 0) explainQuery(&ex[i], q[i], len[i]);
+  readEnd();
+}
+
+
+// Asynchronous queries: an engine answers the queries submitted to it with
+// a pool of threads, and never makes the submitter wait. A submission is
+// accepted, or refused at once if the engine is full; its completion is
+// delivered by a callback on the thread answering it, or put in a
+// completion queue, whose file descriptor is readable while completions
+// wait there, so that an event loop polls it together with its sockets. The
+// threads take the queries waiting together as batches (answerBatch()), so
+// the more queries are in flight, the fewer distinct pairs are searched.
+// The deadline of -D counts from the submission, time in line included.
+
+#define ENGINE_QUEUE 65536    // queries in flight at most, before submissions are refused
+#define QUERY_BATCH 64        // queries taken at once by a thread, when they are waiting
+
+typedef struct completion {
+  void *tag;                 // of the submission
+  char *query;               // as submitted, ended by \0
+  int n;                     // positions, -1 if the query could not be answered
+  PosType *positions;
+  int truncated;             // stopped by -D, -L or its cancellation: the positions found so far
+  double submitted;          // nowUs()
+  _Atomic int *cancelled;    // of the submission
+  void (*callback)(struct completion *c, void *arg);
+  void *arg;
+  struct completion *next;   // in the completion queue
+} Completion;
+
+typedef void (*QueryCallback)(Completion *c, void *arg);
+
+typedef struct {
+  Queue submitted;           // Completion* not answered yet
+  pthread_t *threads;
+  int nthreads;
+  pthread_mutex_t lock;      // of the completion queue
+  Completion *first, *last;
+  int fd;                    // eventfd, readable iff the completion queue is not empty
+} Engine;
+
+
+void completionFree(Completion *c)
+{
+  free(c->query);
+  free(c->positions);
+  free(c);
+}
+
+static void *engineThread(void *arg)
+{
+  Engine *e = (Engine *) ((void **) arg)[0];
+  long id = (long) ((void **) arg)[1];
+  free(arg);
+  // NUMA_REPLICATE: the threads are spread on the nodes, each one reads the copy on its node
+  if (numaPolicy == NUMA_REPLICATE && numaNodes > 1) {
+    queryNode = (int) id % numaNodes;
+    pinToNode(queryNode);
+  }
+
+  Completion *c[QUERY_BATCH];
+  Budget budgets[QUERY_BATCH];
+  unsigned char *q[QUERY_BATCH];
+  int len[QUERY_BATCH], count[QUERY_BATCH], n;
+  PosType *r[QUERY_BATCH];
+  timelineName("query");
+  while ((n = queueGetBatch(&e->submitted, (void **) c, QUERY_BATCH)) > 0) {
+    double start = spanBegin();
+    for (int i = 0; i < n; i++) {
+      q[i] = (unsigned char *) c[i]->query;
+      len[i] = strlen(c[i]->query);
+      budgetInit(&budgets[i], c[i]->submitted, c[i]->cancelled);
+    }
+    answerBatch(q, len, n, r, count, budgets);
+    for (int i = 0; i < n; i++) {
+      c[i]->n = count[i];
+      c[i]->truncated = budgets[i].truncated;
+      if (count[i] > 0) {
+	c[i]->positions = (PosType *) malloc(sizeof(PosType) * count[i]);
+	assert(c[i]->positions != 0, "malloc died in answering a query");
+	memcpy(c[i]->positions, r[i], sizeof(PosType) * count[i]);
+      }
+    }
+    arenaReset(&scratch);
+    spanEnd("batch", start);
+    start = spanBegin();
+
+    // deliver: to the callbacks, or to the completion queue
+    for (int i = 0; i < n; i++)
+      if (c[i]->callback != NULL) {
+	c[i]->callback(c[i], c[i]->arg);
+	completionFree(c[i]);
+	c[i] = NULL;
+      }
+    pthread_mutex_lock(&e->lock);
+    int wasEmpty = (e->first == NULL);
+    for (int i = 0; i < n; i++)
+      if (c[i] != NULL) {
+	if (e->last) e->last->next = c[i];
+	else e->first = c[i];
+	e->last = c[i];
+      }
+    if (wasEmpty && e->first != NULL) {
+      uint64_t one = 1;
+      assert(write(e->fd, &one, sizeof(one)) == sizeof(one), "Error: signaling the completions");
+    }
+    pthread_mutex_unlock(&e->lock);
+    spanEnd("deliver", start);
+  }
+  arenaFree(&scratch);
+  textCacheFree();
+  readerExit();
+  return NULL;
+}
+
+// an engine answering the queries with nthreads threads
+Engine *engineStart(int nthreads)
+{
+  Engine *e = (Engine *) calloc(1, sizeof(Engine));
+  assert(e != 0, "malloc died in starting the engine");
+  queueInit(&e->submitted, ENGINE_QUEUE);
+  pthread_mutex_init(&e->lock, NULL);
+  e->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  assert(e->fd >= 0, "Error: unable to create the completion queue");
+  e->nthreads = nthreads;
+  e->threads = (pthread_t *) malloc(sizeof(pthread_t) * nthreads);
+  assert(e->threads != 0, "malloc died in starting the engine");
+  for (long i = 0; i < nthreads; i++) {
+    void **arg = (void **) malloc(2 * sizeof(void *));
+    assert(arg != 0, "malloc died in starting the engine");
+    arg[0] = e;
+    arg[1] = (void *) i;
+    assert(pthread_create(&e->threads[i], NULL, engineThread, arg) == 0, "Error: unable to start the query threads");
+  }
+  return e;
+}
+
+// submit query (len bytes): its completion, with tag, goes to callback(c, arg) if
+// callback is not NULL, to the completion queue otherwise; setting *cancelled (if
+// not NULL) stops it, truncated. Returns 0 if the engine is full and wait is 0
+// (resubmit it once some queries have completed), 1 if accepted
+int querySubmit(Engine *e, const char *query, int len, void *tag, _Atomic int *cancelled,
+		QueryCallback callback, void *arg, int wait)
+{
+  Completion *c = (Completion *) calloc(1, sizeof(Completion));
+  assert(c != 0 && (c->query = (char *) malloc(len + 1)) != 0, "malloc died in submitting a query");
+  memcpy(c->query, query, len);
+  c->query[len] = 0;
+  c->tag = tag;
+  c->cancelled = cancelled;
+  c->submitted = nowUs();
+  c->callback = callback;
+  c->arg = arg;
+  if (wait) queuePut(&e->submitted, c);
+  else if (!queueTryPut(&e->submitted, c)) {
+    completionFree(c);
+    return 0;
+  }
+  return 1;
+}
+
+// submit n queries at once, without waiting: how many of them were accepted (the first ones)
+int querySubmitBatch(Engine *e, const char **queries, int *len, int n, void **tags, QueryCallback callback, void *arg)
+{
+  int i = 0;
+  while (i < n && querySubmit(e, queries[i], len[i], tags ? tags[i] : NULL, NULL, callback, arg, 0)) i++;
+  return i;
+}
+
+// take at most max completions from the completion queue, without waiting:
+// how many were taken (each one to be freed with completionFree())
+int queryPoll(Engine *e, Completion **done, int max)
+{
+  int n = 0;
+  pthread_mutex_lock(&e->lock);
+  while (n < max && e->first != NULL) {
+    done[n++] = e->first;
+    e->first = e->first->next;
+  }
+  if (e->first == NULL) {
+    uint64_t count;
+    e->last = NULL;
+    if (n > 0) assert(read(e->fd, &count, sizeof(count)) == sizeof(count), "Error: reading the completions");
+  }
+  pthread_mutex_unlock(&e->lock);
+  return n;
+}
+
+// the file descriptor to poll for completions (readable while some wait)
+int engineFd(Engine *e)
+{
+  return e->fd;
+}
+
+// answer the queries submitted, then stop: the completions not taken are dropped
+void engineStop(Engine *e)
+{
+  queueClose(&e->submitted);
+  for (int i = 0; i < e->nthreads; i++)
+    pthread_join(e->threads[i], NULL);
+  for (Completion *c = e->first, *next; c != NULL; c = next) {
+    next = c->next;
+    completionFree(c);
+  }
+  queueDestroy(&e->submitted);
+  pthread_mutex_destroy(&e->lock);
+  close(e->fd);
+  free(e->threads);
+  free(e);
+}
+
+
+// Serving: the lines of stdin, or of the connections to a unix socket, are
+// queries, answered on one line each ("query<TAB>count pos pos ...") in the
+// order they complete, or commands run by the thread reading stdin, or by
+// the command thread for the connections: "!append file" (index the growth of
+// file), "!invalidate from to", "!compact", "!reload" (the file of -i) and
+// "!stats" (dump the counters). Queries never wait for the commands: they run
+// on the version current when they start; the lines of a connection after a
+// command are read once it is done.
+
+#define MAXCONNECTIONS 1024
+
+// the answer line of a query: n < 0 if it could not be answered, truncated if
+// the positions are those found before -D or -L stopped it
+void printAnswer(FILE *out, const char *query, PosType *r, int n, int truncated)
+{
+  double start = nowUs();
+  flockfile(out);
+  if (n < 0)
+    fprintf(out, "%s\terror: wrong query length\n", query);
+  else {
+    fprintf(out, "%s\t%d", query, n);
+    for (int j = 0; j < n; j++) fprintf(out, " %ld", r[j]);
+    fprintf(out, truncated ? "\ttruncated\n" : "\n");
+  }
+  fflush(out);
+  funlockfile(out);
+  statPhase(PHASE_OUTPUT, start);
+}
+
+// the chains of the hash table by their length, counted once after its build
+// (it does not change afterwards)
+uint64_t htabChains[STAT_BINS], htabEntries;
+
+void countHtabChains()
+{
+  for (uint64_t b = 0; b < HSIZE; b++) {
+    uint64_t n = 0;
+    for (Hptr p = htab[b]; p; p = p->next) n++;
+    htabChains[statBin(n)]++;
+    htabEntries += n;
+  }
+}
+
+// a histogram of STAT_BINS bins as a JSON array, up to its last bin used
+static void printHistogram(FILE *f, uint64_t *h)
+{
+  int last = STAT_BINS - 1;
+  while (last > 0 && h[last] == 0) last--;
+  fprintf(f, "[");
+  for (int i = 0; i <= last; i++) fprintf(f, "%s%llu", i ? ", " : "", (unsigned long long) h[i]);
+  fprintf(f, "]");
+}
+
+// the counters, the phases and the shape of the index served, as JSON in the file
+// of -J (rewritten each time) or on stderr
+void dumpStats()
+{
+  FILE *f = (statsFile == NULL || strcmp(statsFile, "-") == 0) ? stderr : fopen(statsFile, "w");
+  if (f == NULL) {
+    fprintf(stderr, "  unable to write the counters in %s\n", statsFile);
+    return;
+  }
+
+  // the chains of the index: lists of the buckets of htab or static (deltas aside),
+  // counted once per index; a mapped one is counted by its first dump
+  uint64_t chains[STAT_BINS] = {0}, entries = 0;
+  IndexVersion *v = readBegin();
+  if (backend == BACKEND_HTAB && htab != NULL) {
+    memcpy(chains, htabChains, sizeof(chains));
+    entries = htabEntries;
+  } else if (backend == BACKEND_STATIC && v != NULL && v->base != NULL) {
+    StaticIndex *x = v->base;
+    if (!x->chainsKnown) {
+      for (uint64_t b = 0; b < x->hdr->nbuckets; b++)
+	x->chains[statBin(x->buckets[b+1] - x->buckets[b])]++;
+      x->chainsKnown = 1;
+    }
+    memcpy(chains, x->chains, sizeof(chains));
+    entries = x->hdr->nentries;
+  }
+  const char *name[] = {"htab", "fm", "sa", "static"};
+  flockfile(f);
+  fprintf(f, "{\n  \"backend\": \"%s\",\n", name[backend]);
+  fprintf(f, "  \"index\": {\"text_length\": %ld, \"entries\": %llu, \"deltas\": %d, \"chains\": ",
+	  (long) ((backend == BACKEND_STATIC && v != NULL) ? indexedLength(v) : oldTextLength),
+	  (unsigned long long) entries, v ? v->ndeltas : 0);
+  readEnd();
+  printHistogram(f, chains);
+
+  fprintf(f, "},\n  \"counters\": {");
+  const char *counter[] = {"positions", "entries", "queries", "pairs", "candidates", "duplicates", "verified", "rejected", "truncated"};
+  _Atomic uint64_t *value[] = {&stats.positions, &stats.entries, &stats.queries, &stats.pairs, &stats.candidates,
+			       &stats.duplicates, &stats.verified, &stats.rejected, &stats.truncated};
+  for (int i = 0; i < 9; i++)
+    fprintf(f, "%s\"%s\": %llu", i ? ", " : "", counter[i], (unsigned long long) atomic_load(value[i]));
+
+  uint64_t h[STAT_BINS];
+  for (int i = 0; i < STAT_BINS; i++) h[i] = atomic_load(&stats.pairCandidates[i]);
+  fprintf(f, "},\n  \"pair_candidates\": ");
+  printHistogram(f, h);
+
+  fprintf(f, ",\n  \"phases\": {");
+  for (int i = 0; i < NPHASES; i++)
+    fprintf(f, "%s\"%s\": {\"seconds\": %.6f, \"count\": %llu}", i ? ", " : "", phaseName[i],
+	    atomic_load(&stats.phaseNs[i]) / 1e9, (unsigned long long) atomic_load(&stats.phaseCount[i]));
+  fprintf(f, "}\n}\n");
+  fflush(f);
+  funlockfile(f);
+  if (f != stderr) fclose(f);
+}
+
+pthread_mutex_t commandLock = PTHREAD_MUTEX_INITIALIZER;   // commands come from stdin and the reloads
+const char *servedIndex = NULL;                            // file of -i, kept in sync by the commands
+
+// a command of the writer; indexName: the saved index, if any, kept in sync
+void serveCommand(char *line, const char *indexName)
+{
+  pthread_mutex_lock(&commandLock);
+  char arg[4096];
+  long from, to;
+  if (strcmp(line, "!stats") == 0)
+    dumpStats();
+  else if (sscanf(line, "!invalidate %ld %ld", &from, &to) == 2) {
+    invalidateRange(from, to);
+    if (indexName != NULL) {
+      pthread_mutex_lock(&writerLock);
+      saveTombstones(atomic_load(&current), indexName);
+      pthread_mutex_unlock(&writerLock);
+    }
+    fprintf(stderr, "  invalidated [%ld,%ld)\n", from, to);
+  } else if (backend != BACKEND_STATIC)
+    fprintf(stderr, "  %s: the %s backend is not updatable\n", line, (backend == BACKEND_FM) ? "fm" : (backend == BACKEND_SA) ? "sa" : "htab");
+  else if (sscanf(line, "!append %4095s", arg) == 1) {
+    appendFromFile(arg);
+    fprintf(stderr, "\n");
+  } else if (strcmp(line, "!compact") == 0) {
+    startCompaction(indexName);
+    fprintf(stderr, "  compaction started\n");
+  } else if (strcmp(line, "!reload") == 0 && indexName != NULL)
+    reloadIndex(indexName, 1);
+  else
+    fprintf(stderr, "  unknown command %s\n", line);
+  pthread_mutex_unlock(&commandLock);
+}
+
+// strip the end of line of a line read with getline(), returning its length
+static ssize_t chomp(char *line, ssize_t len)
+{
+  while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) line[--len] = 0;
+  return len;
+}
+
+// a connection of -U
+typedef struct {
+  int fd;
+  char *in;                  // bytes read and not consumed yet
+  size_t inLength, inCapacity;
+  char *out;                 // answers not written yet, from outDone on
+  size_t outLength, outDone;
+  int inFlight;              // queries submitted and not completed
+  int eof;                   // the client sent all its lines: it goes once they are answered
+  char *command;             // its command running on the command thread, its next lines wait
+  _Atomic int commanding;
+  _Atomic int closed;        // by the client: its queries are cancelled, it is freed once inFlight is 0
+} Connection;
+
+// the commands of the connections run one at a time on their own thread, so
+// that a compaction or a reload does not stall the other connections; each
+// one signals commandFd when done
+Queue commands;
+int commandFd;
+
+static void *commandThread(void *arg)
+{
+  (void) arg;
+  Connection *c;
+  while ((c = (Connection *) queueGet(&commands)) != NULL) {
+    serveCommand(c->command, servedIndex);
+    free(c->command);
+    c->command = NULL;
+    atomic_store(&c->commanding, 0);
+    uint64_t one = 1;
+    assert(write(commandFd, &one, sizeof(one)) == sizeof(one), "Error: signaling the commands");
+  }
+  return NULL;
+}
+
+// submit the whole lines read from c, up to its next command (handed to the
+// command thread); 0 if the engine is full
+static int readLines(Engine *e, Connection *c)
+{
+  int accepted = 1;
+  size_t start = 0;
+  char *nl;
+  while (accepted && !atomic_load(&c->commanding) && (nl = memchr(c->in + start, '\n', c->inLength - start)) != NULL) {
+    *nl = 0;
+    char *line = c->in + start;
+    ssize_t len = chomp(line, nl - line);
+    if (len > 0 && line[0] == '!') {
+      c->command = strdup(line);
+      assert(c->command != 0, "malloc died in reading a connection");
+      atomic_store(&c->commanding, 1);
+      queuePut(&commands, c);
+    }
+    else if (len > 0 && !(accepted = querySubmit(e, line, len, c, &c->closed, NULL, NULL, 0))) {
+      *nl = '\n';            // read again once there is room
+      break;
+    }
+    else if (len > 0) c->inFlight++;
+    start = nl + 1 - c->in;
+  }
+  memmove(c->in, c->in + start, c->inLength - start);
+  c->inLength -= start;
+  return accepted;
+}
+
+// the answer of c, queued on its connection
+static void queueAnswer(Completion *done)
+{
+  Connection *c = (Connection *) done->tag;
+  c->inFlight--;
+  if (c->closed) return;
+  char *line;
+  size_t size;
+  FILE *f = open_memstream(&line, &size);
+  assert(f != NULL, "malloc died in answering a connection");
+  printAnswer(f, done->query, done->positions, done->n, done->truncated);
+  fclose(f);
+  c->out = (char *) realloc(c->out, c->outLength + size);
+  assert(c->out != 0, "malloc died in answering a connection");
+  memcpy(c->out + c->outLength, line, size);
+  c->outLength += size;
+  free(line);
+}
+
+// serve the connections to the unix socket socketName, until the process is
+// killed: one thread polls all of them and the completions of the engine. A
+// client shutting down its end for writing still gets all its answers; a
+// hang up or a failed write cancels its queries
+void serveSocket(Engine *e, const char *socketName)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  assert(strlen(socketName) < sizeof(addr.sun_path), "Error: socket name too long");
+  strcpy(addr.sun_path, socketName);
+  unlink(socketName);
+  int s = socket(AF_UNIX, SOCK_STREAM, 0);
+  assert(s >= 0 && bind(s, (struct sockaddr *) &addr, sizeof(addr)) == 0 && listen(s, 64) == 0,
+	 "Error: unable to listen on the socket");
+  fcntl(s, F_SETFL, O_NONBLOCK);
+  queueInit(&commands, MAXCONNECTIONS);   // one command per connection at most
+  commandFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  pthread_t commander;
+  assert(commandFd >= 0 && pthread_create(&commander, NULL, commandThread, NULL) == 0,
+	 "Error: unable to start the commands");
+  fprintf(stderr, "  serving on %s\n", socketName);
+
+  Connection *conn[MAXCONNECTIONS];
+  struct pollfd fds[MAXCONNECTIONS + 3];
+  Completion *done[QUERY_BATCH];
+  int nconn = 0, full = 0;   // full: the engine refused a query, reading waits for completions
+  for (;;) {
+    fds[0].fd = (nconn < MAXCONNECTIONS) ? s : -1;
+    fds[0].events = POLLIN;
+    fds[1].fd = engineFd(e);
+    fds[1].events = POLLIN;
+    fds[2].fd = commandFd;
+    fds[2].events = POLLIN;
+    for (int i = 0; i < nconn; i++) {
+      Connection *c = conn[i];
+      fds[i+3].fd = c->closed ? -1 : c->fd;
+      fds[i+3].events = ((full || c->eof) ? 0 : POLLIN) | ((c->outDone < c->outLength) ? POLLOUT : 0);
+      fds[i+3].revents = 0;
+    }
+    if (poll(fds, nconn + 3, -1) < 0) continue;
+    int polled = nconn;      // the connections accepted below wait for the next round
+
+    if (fds[0].revents & POLLIN) {
+      int fd = accept(s, NULL, NULL);
+      if (fd >= 0) {
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	Connection *c = (Connection *) calloc(1, sizeof(Connection));
+	assert(c != 0, "malloc died in accepting a connection");
+	c->fd = fd;
+	conn[nconn++] = c;
+      }
+    }
+
+    // the answers completed go to their connections; the lines held back,
+    // by a full engine or a command, are read again
+    int n, resume = 0;
+    while ((n = queryPoll(e, done, QUERY_BATCH)) > 0) {
+      for (int i = 0; i < n; i++) {
+	queueAnswer(done[i]);
+	completionFree(done[i]);
+      }
+      resume = full;
+    }
+    uint64_t count;
+    if ((fds[2].revents & POLLIN) && read(commandFd, &count, sizeof(count)) == sizeof(count)) resume = 1;
+    if (resume) {
+      full = 0;
+      for (int i = 0; i < nconn && !full; i++)
+	if (!conn[i]->closed) full = !readLines(e, conn[i]);
+    }
+
+    for (int i = 0; i < nconn; i++) {
+      Connection *c = conn[i];
+      short ev = (i < polled) ? fds[i+3].revents : 0;
+      if (ev & (POLLHUP | POLLERR)) c->closed = 1;
+      if (!c->closed && !c->eof && !full && (ev & POLLIN)) {
+	if (c->inCapacity - c->inLength < 4096) {
+	  c->inCapacity = 2 * c->inCapacity + 4096;
+	  c->in = (char *) realloc(c->in, c->inCapacity);
+	  assert(c->in != 0, "malloc died in reading a connection");
+	}
+	ssize_t m = read(c->fd, c->in + c->inLength, c->inCapacity - c->inLength);
+	if (m > 0) c->inLength += m;
+	else if (m == 0) {   // no more lines, the last one may lack its end of line
+	  c->eof = 1;
+	  if (c->inLength > 0 && c->in[c->inLength-1] != '\n') c->in[c->inLength++] = '\n';
+	} else if (errno != EAGAIN) c->closed = 1;
+	if (m >= 0) full = !readLines(e, c);
+      }
+      if (!c->closed && c->outDone < c->outLength) {
+	ssize_t m = write(c->fd, c->out + c->outDone, c->outLength - c->outDone);
+	if (m > 0) c->outDone += m;
+	else if (m < 0 && errno != EAGAIN) c->closed = 1;
+	if (c->outDone == c->outLength) c->outDone = c->outLength = 0;
+      }
+    }
+
+    // the connections closed, or answered up to their end, go once their
+    // queries and command are done
+    for (int i = 0; i < nconn; ) {
+      Connection *c = conn[i];
+      int answered = c->eof && c->inLength == 0 && c->outLength == 0;
+      if ((c->closed || answered) && c->inFlight == 0 && !atomic_load(&c->commanding)) {
+	close(c->fd);
+	free(c->in);
+	free(c->out);
+	free(c);
+	conn[i] = conn[--nconn];
+      } else i++;
+    }
+  }
+}
+
+// the answer of a query of stdin, printed by the thread answering it
+static void printCompletion(Completion *c, void *arg)
+{
+  (void) arg;
+  printAnswer(stdout, c->query, c->positions, c->n, c->truncated);
+}
+
+void serve(int nthreads, const char *indexName, const char *socketName)
+{
+  pthread_t reloader;
+  servedIndex = indexName;
+  if (indexName != NULL) {
+    signal(SIGHUP, onSighup);
+    assert(pthread_create(&reloader, NULL, reloadThread, (void *) indexName) == 0, "Error: unable to start the reloads");
+  }
+  Engine *e = engineStart(nthreads);
+  if (socketName != NULL) serveSocket(e, socketName);
+
+  char *line = NULL;
+  size_t capacity = 0;
+  ssize_t len;
+  while ((len = getline(&line, &capacity, stdin)) >= 0) {
+    if (chomp(line, len) == 0) continue;
+    if (line[0] == '!') serveCommand(line, indexName);
+    else querySubmit(e, line, strlen(line), NULL, NULL, printCompletion, NULL, 1);
+  }
+  free(line);
+
+  engineStop(e);
+  if (atomic_load(&pairsAsked) > 0)
+    fprintf(stderr, "\n pairs of the batches: %llu, searched %llu (distinct)\n",
+	    (unsigned long long) atomic_load(&pairsAsked), (unsigned long long) atomic_load(&pairsSearched));
+  if (indexName != NULL) {
+    reloadStop = 1;
+    pthread_join(reloader, NULL);
+  }
+}
+
+
+// Sharding: -n shards splits the text in ranges, each one extended by
+// queryLen-1 bytes so that the windows across a border stay whole, and saves
+// a static index per range (index.0, index.1, ...) plus the manifest
+// "index.shards" with the text offset of each. Every shard is served by a
+// process of its own on a unix socket (-i index.3 -s -U index.3.sock), and
+// a coordinator (-C index) sends each query to all of them at once, then
+// merges their answers in global positions.
+
+#define MAXSHARDS 256
+
+typedef struct {
+  PosType offset;            // text position of the first byte of the shard
+  char name[4096];           // its index, served on name.sock
+  int fd;
+  FILE *in, *out;            // the connection to its server
+  long queries;
+  double totalUs, maxUs;     // latency of its answers
+} Shard;
+
+Shard shards[MAXSHARDS];
+int nshards = 0;
+
+
+void buildShards(unsigned char *text, PosType len, int blockSize, int n, const char *prefix)
+{
+  int queryLen = 4 * blockSize;
+  char name[4096];
+  snprintf(name, sizeof(name), "%s.shards", prefix);
+  FILE *m = fopen(name, "w");
+  assert(m != NULL, "Error: Unable to write the shard manifest");
+
+  for (int i = 0; i < n; i++) {
+    PosType from = len * i / n;
+    PosType to = (i == n-1) ? len : len * (i+1) / n + queryLen - 1;
+    if (to > len) to = len;
+    StaticIndex x;
+    memset(&x, 0, sizeof(x));
+    fprintf(stderr, "\n  shard %d [%ld,%ld):", i, (long) from, (long) to);
+    snprintf(name, sizeof(name), "%s.%d", prefix, i);
+
+    // a shard saved by a previous build of the same text is a checkpoint: it is kept
+    int fd = open(name, O_RDONLY);
+    int mappedOld = (fd >= 0 && mapImage(&x, fd) == NULL);
+    if (fd >= 0) close(fd);
+    if (mappedOld) {
+      int same = x.hdr->blockSize == (uint32_t) blockSize && x.hdr->hashSeed == hashSeed
+	&& x.hdr->textLength == (uint64_t) (to - from) && x.hdr->textChecksum == textChecksum(text + from, to - from)
+	&& x.hdr->textCodec == (uint32_t) textCodec;
+      destroyStatic(&x);
+      if (same) {
+	fprintf(stderr, " kept from a previous build");
+	fprintf(m, "%ld %s\n", (long) from, name);
+	continue;
+      }
+    }
+
+    buildStatic(&x, text + from, to - from, blockSize, textCodec, NULL);
+    saveStatic(&x, name);    // a shard is there whole or not at all
+    destroyStatic(&x);
+    fprintf(m, "%ld %s\n", (long) from, name);
+  }
+  assert(fclose(m) == 0, "Error: writing the shard manifest");
+  fprintf(stderr, "\n  saved %d shards, listed in %s.shards\n", n, prefix);
+}
+
+// connect to the servers of the shards listed in the manifest of prefix
+void connectShards(const char *prefix)
+{
+  char name[4096];
+  long offset;
+  snprintf(name, sizeof(name), "%s.shards", prefix);
+  FILE *m = fopen(name, "r");
+  assert(m != NULL, "Error: Unable to open the shard manifest");
+  while (nshards < MAXSHARDS && fscanf(m, "%ld %4090s", &offset, name) == 2) {
+    Shard *sh = &shards[nshards++];
+    sh->offset = offset;
+    strcpy(sh->name, name);
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    assert(strlen(name) + sizeof(".sock") <= sizeof(addr.sun_path), "Error: shard name too long for its socket");
+    strcpy(addr.sun_path, name);
+    strcat(addr.sun_path, ".sock");
+    sh->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sh->fd < 0 || connect(sh->fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+      fprintf(stderr, "\n\nError: no server for the shard %s on %s\n", name, addr.sun_path);
+      exit(1);
+    }
+    sh->in = fdopen(sh->fd, "r");
+    sh->out = fdopen(dup(sh->fd), "w");
+  }
+  fclose(m);
+  assert(nshards > 0, "Error: empty shard manifest");
+}
+
+void disconnectShards()
+{
+  for (int i = 0; i < nshards; i++) {
+    fclose(shards[i].in);
+    fclose(shards[i].out);
+  }
+  nshards = 0;
+}
+
+// Scatter query to all the shards, then gather their answers as they come:
+// the positions, made global, are left sorted in *results (scratch memory),
+// and their number is returned (-1 if a shard could not answer); *truncated
+// tells whether a shard stopped the query (-D or -L of its server)
+int coordinateQuery(const char *query, PosType **results, int *truncated)
+{
+  *truncated = 0;
+  struct pollfd fds[nshards];
+  double start = nowUs();
+  for (int i = 0; i < nshards; i++) {
+    fprintf(shards[i].out, "%s\n", query);
+    fflush(shards[i].out);
+    fds[i].fd = shards[i].fd;
+    fds[i].events = POLLIN;
+  }
+
+  PosType *r = (PosType *) arenaAlloc(&scratch, sizeof(PosType));
+  int rSize = 0, failed = 0, pending = nshards;
+  size_t queryLen = strlen(query), capacity = 0;
+  char *line = NULL;
+  while (pending > 0) {
+    assert(poll(fds, nshards, -1) > 0, "Error: waiting for the shards");
+    for (int i = 0; i < nshards; i++) {
+      if (fds[i].fd < 0 || !(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+      Shard *sh = &shards[i];
+      ssize_t len = getline(&line, &capacity, sh->in);   // one line per query: nothing stays buffered
+      assert(len >= 0, "Error: a shard server closed the connection");
+      double us = nowUs() - start;
+      sh->queries++;
+      sh->totalUs += us;
+      if (us > sh->maxUs) sh->maxUs = us;
+      fds[i].fd = -1;
+      pending--;
+
+      char *p = line + queryLen, *end;
+      long n = (*p == '\t') ? strtol(p + 1, &end, 10) : -1;
+      if (n < 0 || end == p + 1) { failed = 1; continue; }
+      r = (PosType *) arenaGrow(&scratch, r, (rSize + 1) * sizeof(PosType), (rSize + n + 1) * sizeof(PosType));
+      for (long j = 0; j < n; j++)
+	r[rSize++] = strtol(end, &end, 10) + sh->offset;
+      if (strncmp(end, "\ttruncated", 10) == 0) *truncated = 1;
+    }
+  }
+  free(line);
+  if (failed) return -1;
 
-  // Results available in r[] and their are rSize
-  for(int j=0; j < rSize; j++)
-    fprintf(stderr,"%ld\n",r[j]);
-  exit(0);
+  // the overlaps of the shards may give a position twice
+  qsort(r, rSize, sizeof(PosType), &int_cmp);
+  *results = r;
+  return removeDuplicates(r, rSize);
 }
 
+// queries of stdin answered through the shards, one line each on stdout
+void coordinate()
+{
+  char *line = NULL;
+  size_t capacity = 0;
+  ssize_t len;
+  while ((len = getline(&line, &capacity, stdin)) >= 0) {
+    if (chomp(line, len) == 0) continue;
+    if (line[0] == '!') {
+      fprintf(stderr, "  commands go to the servers of the shards\n");
+      continue;
+    }
+    PosType *r;
+    int truncated, n = coordinateQuery(line, &r, &truncated);
+    printAnswer(stdout, line, r, n, truncated);
+    arenaReset(&scratch);
+  }
+  free(line);
+}
+
+void reportShards()
+{
+  fprintf(stderr, "\n shards:\n");
+  for (int i = 0; i < nshards; i++)
+    fprintf(stderr, "   %-24s offset %12ld  %8ld queries  latency mean %.0f us, max %.0f us\n",
+	    shards[i].name, (long) shards[i].offset, shards[i].queries,
+	    shards[i].queries ? shards[i].totalUs / shards[i].queries : 0.0, shards[i].maxUs);
+}
+
+
+// release everything main() built or mapped (ownText: oldText was fetched, not mapped)
+void destroyIndex(int ownText)
+{
+  finishCompaction();
+  pthread_mutex_lock(&writerLock);
+  publishVersion(NULL);      // no query runs: all the versions are freed
+  pthread_mutex_unlock(&writerLock);
+  destroyHtab();
+  destroySA();
+  destroyFM();
+  if (ownText) indexFree(oldText);
+  oldText = NULL;
+  oldTextLength = 0;
+}
+
+#define USAGE "Usage: ApproxIndex [-b htab|fm|sa|static] [-f file] [-o index | -i index] [-S name | -A name]" \
+  " [-H none|thp|2m|1g] [-N interleave|local[:node]|replicate] [-c] [-x from:to] [-s [-t threads] [-U socket]]" \
+  " [-n shards | -C index] [-M budget] [-z] [-k mismatches] [-T budget] [-R budget] [-D ms] [-L candidates] [-J file] [-v level] [-E file] [-P file] [-V] queryString"
+
+int main(int argc, char *argv[])
+{
+  Source old_file;    
+  const char *oldFileName = "old_file.dat";
+  const char *indexIn = NULL, *indexOut = NULL, *shmOut = NULL, *shmIn = NULL;
+  const char *socketName = NULL, *coordinated = NULL;
+  int fileGiven = 0, compact = 0, newTombs = 0, serving = 0, nthreads = 1, nshardsOut = 0;
+  size_t budget = 0;
+  int opt;
+
+  // options: -b htab|fm|sa|static (search backend), -f file (file to index),
+  // -o index (save the static index), -i index (map a saved index instead of building),
+  // -S name (build the static index in shared memory), -A name (attach to a shared index),
+  // -H none|thp|2m|1g (huge pages), -N interleave|local[:node]|replicate (NUMA placement),
+  // -c (compact the appends to the file of -i into it), -x from:to (invalidate a range, repeatable),
+  // -s (serve the queries of stdin, then the queryString is optional), -t threads (answering them),
+  // -U socket (serve the connections to a unix socket instead, answered by the same threads),
+  // -n shards (save -o index in shards),
+  // -C index (answer through the servers of the shards of index), -M budget (build the index
+  // of -o within budget bytes of memory, suffixes k, m and g), -z (compress the text of the
+  // static index in blocks), -k mismatches (answer the positions verified within them),
+  // -T budget (keep the long lists of entries of the index of -i on disk, caching budget bytes),
+  // -R budget (cache the answers of the queries in budget bytes), -D ms (deadline of each query)
+  // and -L candidates (bound of the candidates of each query): the answers are then truncated,
+  // -J file (dump the counters and the phase timers as JSON at the end, "-" for stderr),
+  // -v level (verbosity of the traces: 0 none, 1 the pairs of the query, 2 the build),
+  // -E file (explain every query in a line of JSON, "-" for stderr),
+  // -P file (record a timeline of the threads, written as Chrome trace events),
+  // -V (verify the whole directory and text of the index of -i or -A when it is mapped)
+  while ((opt = getopt(argc, argv, "b:f:i:o:S:A:H:N:cx:st:U:n:C:M:zk:T:R:D:L:J:v:E:P:V")) != -1) {
+    switch (opt) {
+    case 'b':
+      if (strcmp(optarg, "htab") == 0) backend = BACKEND_HTAB;
+      else if (strcmp(optarg, "fm") == 0) backend = BACKEND_FM;
+      else if (strcmp(optarg, "sa") == 0) backend = BACKEND_SA;
+      else if (strcmp(optarg, "static") == 0) backend = BACKEND_STATIC;
+      else assert(0, "Error, unknown backend (use htab, fm, sa or static)");
+      break;
+    case 'f':
+      oldFileName = optarg;
+      fileGiven = 1;
+      break;
+    case 'c':
+      compact = 1;
+      break;
+    case 'x': {
+      long from, to;
+      assert(sscanf(optarg, "%ld:%ld", &from, &to) == 2, "Error, ranges are given as from:to");
+      invalidateRange(from, to);
+      newTombs = 1;
+      break;
+    }
+    case 's':
+      serving = 1;
+      break;
+    case 't':
+      nthreads = atoi(optarg);
+      assert(nthreads > 0 && nthreads <= MAXREADERS - 2, "Error, wrong number of query threads");
+      break;
+    case 'U':
+      socketName = optarg;
+      break;
+    case 'n':
+      nshardsOut = atoi(optarg);
+      assert(nshardsOut > 0 && nshardsOut <= MAXSHARDS, "Error, wrong number of shards");
+      backend = BACKEND_STATIC;
+      break;
+    case 'C':
+      coordinated = optarg;
+      break;
+    case 'M':
+      budget = parseSize(optarg);
+      assert(budget >= EXTERNAL_MIN_BUDGET, "Error, the memory budget of -M is at least 1m");
+      backend = BACKEND_STATIC;
+      break;
+    case 'R':
+      resultBudget = parseSize(optarg);
+      assert(resultBudget > 0, "Error, wrong budget of the result cache");
+      initResultCache();
+      break;
+    case 'J':
+      statsFile = optarg;
+      break;
+    case 'P':
+      timelineFile = optarg;
+      timelineOrigin = nowUs();
+      timelineName("main");
+      break;
+    case 'E':
+      explainFile = (strcmp(optarg, "-") == 0) ? stderr : fopen(optarg, "w");
+      assert(explainFile != NULL, "Error: unable to write the explained queries");
+      break;
+    case 'v':
+      verbosity = atoi(optarg);
+      if (verbosity > TRACE_LEVEL)
+	fprintf(stderr, "  traces above level %d are not compiled in (-DTRACE_LEVEL)\n", TRACE_LEVEL);
+      break;
+    case 'D':
+      deadlineMs = atof(optarg);
+      assert(deadlineMs > 0, "Error, wrong deadline of the queries");
+      break;
+    case 'L':
+      maxCandidates = atol(optarg);
+      assert(maxCandidates > 0, "Error, wrong bound of the candidates");
+      break;
+    case 'V':
+      verifyIndex = 1;
+      break;
+    case 'T':
+      tierBudget = parseSize(optarg);
+      assert(tierBudget > 0, "Error, wrong budget of the cache of lists");
+      break;
+    case 'z':
+      textCodec = packCodec();
+      backend = BACKEND_STATIC;
+      break;
+    case 'k':
+      maxMismatches = atoi(optarg);
+      assert(maxMismatches >= 0 && maxMismatches <= MAXMISMATCHES, "Error, the index answers up to 2 mismatches");
+      break;
+    case 'i':
+      indexIn = optarg;
+      backend = BACKEND_STATIC;
+      break;
+    case 'o':
+      indexOut = optarg;
+      backend = BACKEND_STATIC;
+      break;
+    case 'S':
+      shmOut = optarg;
+      backend = BACKEND_STATIC;
+      break;
+    case 'A':
+      shmIn = optarg;
+      backend = BACKEND_STATIC;
+      break;
+    case 'H':
+      if (strcmp(optarg, "none") == 0) hugePages = PAGES_DEFAULT;
+      else if (strcmp(optarg, "thp") == 0) hugePages = PAGES_THP;
+      else if (strcmp(optarg, "2m") == 0) hugePages = PAGES_2MB;
+      else if (strcmp(optarg, "1g") == 0) hugePages = PAGES_1GB;
+      else assert(0, "Error, unknown huge pages (use none, thp, 2m or 1g)");
+      break;
+    case 'N':
+      if (strcmp(optarg, "interleave") == 0) numaPolicy = NUMA_INTERLEAVE;
+      else if (strcmp(optarg, "replicate") == 0) numaPolicy = NUMA_REPLICATE;
+      else if (strncmp(optarg, "local", 5) == 0) {
+	numaPolicy = NUMA_LOCAL;
+	numaNode = (optarg[5] == ':') ? atoi(optarg + 6) : 0;
+      }
+      else assert(0, "Error, unknown numa policy (use interleave, local[:node] or replicate)");
+      break;
+    default:
+      assert(0, USAGE);
+    }
+  }
+  assert(optind < argc || serving, USAGE);
+  assert(textCodec == TEXT_PLAIN || backend == BACKEND_STATIC,
+	 "Error, -z compresses the text of the static index, not the one of -b htab, fm or sa");
+  assert(tierBudget == 0 || ((indexIn != NULL || budget > 0) && numaPolicy != NUMA_REPLICATE),
+	 "Error, -T keeps on disk the lists of the index file of -i or -M, not replicated");
+  char *queryArg = (optind < argc) ? argv[optind] : "";
+
+  // queryArg = string to be searched (assume ended by \0)
+  unsigned char *queryStr = (unsigned char *) calloc(strlen(queryArg) + 1, 1); // fm and sa take queries of any length
+  assert(queryStr != 0, "malloc died in reading the query");
+  for(size_t i=0; i<strlen(queryArg); i++)
+    queryStr[i]=queryArg[i];
+  
+  int queryLen = strlen(queryArg);
+  if (queryLen % 4 != 0){
+    printf("Error, query length should be a multiple of 4\n\n");
+    exit(1);
+  }
+
+
+  int blockSize = queryLen/4;  //We split the queryString in 4 blocks of equal length
+
+  if (coordinated != NULL) {
+    // the index is in the shards, each one behind its own server
+    connectShards(coordinated);
+    if (queryLen > 0) {
+      PosType *r;
+      int truncated, rSize = coordinateQuery(queryArg, &r, &truncated);
+      if (rSize < 0) fprintf(stderr, "Error, the shards answer queries of another length\n");
+      for(int j=0; j < rSize; j++)
+	fprintf(stderr,"%ld\n",r[j]);
+      if (truncated) fprintf(stderr, "  truncated by a shard\n");
+      arenaReset(&scratch);
+    }
+    if (serving) coordinate();
+    reportShards();
+    disconnectShards();
+    arenaFree(&scratch);
+    free(queryStr);
+    return 0;
+  }
+
+  numaNodes = countNodes();
+  if (numaNode >= numaNodes) numaNode = 0;
+  if (numaPolicy == NUMA_LOCAL) pinToNode(numaNode);
+
+  if (budget > 0) {
+    // the index file is built out of core, then mapped as a saved one
+    assert(indexOut != NULL && indexIn == NULL && shmOut == NULL && nshardsOut == 0 && queryLen > 0,
+	   "Error, -M builds the index file of -o for the length of the queryString");
+    fprintf(stderr,"Building the index file within %zu bytes...", budget);
+    double start = nowUs();
+    readBegin();             // the tombstones of -x
+    buildExternal(oldFileName, blockSize, textCodec, budget, indexOut);
+    readEnd();
+    statPhase(PHASE_BUILD, start);
+    spanEnd("build", start);
+    fprintf(stderr,"\n");
+    indexIn = indexOut;
+  }
+
+  StaticIndex *base = NULL;
+  int mapped = (indexIn != NULL || shmIn != NULL);
+  if (mapped) {
+    // map a saved or shared index, the text comes with it
+    fprintf(stderr,"  mapping index...");
+    double start = nowUs();
+    base = (StaticIndex *) calloc(1, sizeof(StaticIndex));
+    assert(base != 0, "malloc died in mapping the index");
+    if (shmIn != NULL) attachShared(base, shmIn);
+    else loadStatic(base, indexIn);
+    if (indexIn != NULL) stat(indexIn, &indexStat);
+    if (queryLen > 0 && (int) base->hdr->blockSize != blockSize) {
+      fprintf(stderr,"\n\nError: the index answers queries of length %d\n", 4 * base->hdr->blockSize);
+      exit(1);
+    }
+    indexBlockSize = base->hdr->blockSize;
+    statPhase(PHASE_LOAD, start);
+    spanEnd("map", start);
+    fprintf(stderr,"... mapped!!");
+  } else {
+  assert(queryLen > 0 || backend == BACKEND_FM || backend == BACKEND_SA,
+	 "Error: the length of the queryString fixes the one of the queries answered by the index");
+  indexBlockSize = blockSize;
+
+  // fetch the old file in oldText (with htab, the load overlaps the build: each
+  // phase reports on its own line)
+  fprintf(stderr, (backend == BACKEND_HTAB) ? "  fetching file in the background...\n" : "  fetching file...");
+  double start = nowUs();
+  if (!sourceOpen(&old_file, oldFileName)) {
+    fprintf(stderr,"\n\nError: Unable to open %s\n",oldFileName);
+    exit (8);  }
+
+  oldTextLength = old_file.length;
+
+  oldText = (unsigned char *) indexAlloc(oldTextLength+1, "text");
+  startReader(&old_file);    // the text arrives while the hash table is built
+
+  if (backend == BACKEND_HTAB) {
+    // Construct the dictionary of blocks of size 2 * blockSize
+    fprintf(stderr,"Building hash table...");
+    htab = (Hptr *) indexAlloc(HSIZE * sizeof(Hptr), "hash table");
+    double built = nowUs();
+    buildHtab(blockSize);
+    fprintf(stderr,"... built!!\n");
+    if (statsFile != NULL) countHtabChains();
+    statPhase(PHASE_BUILD, built);
+    spanEnd("build", built);
+  }
+  finishReader();
+  statPhase(PHASE_LOAD, start);
+  spanEnd("load", start);
+
+  trace(TRACE_BUILD, "\n%s\n\n", oldText);
+  fprintf(stderr, (backend == BACKEND_HTAB) ? "  ... fetched!!\n" : "... fetched!!\n");
+
+  if (nshardsOut > 0) {
+    assert(indexOut != NULL && !newTombs, "Error, shards are saved with -o index, and without -x");
+    fprintf(stderr,"Building shards...");
+    buildShards(oldText, oldTextLength, blockSize, nshardsOut, indexOut);
+    indexFree(oldText);
+    free(queryStr);
+    return 0;
+  } else if (backend == BACKEND_STATIC) {
+    fprintf(stderr,"Building static index...");
+    base = (StaticIndex *) calloc(1, sizeof(StaticIndex));
+    assert(base != 0, "malloc died in static index construction");
+    start = nowUs();
+    readBegin();             // the tombstones of -x
+    buildStatic(base, oldText, oldTextLength, blockSize, textCodec, shmOut);
+    readEnd();
+    if (indexOut != NULL) saveStatic(base, indexOut);
+    statPhase(PHASE_BUILD, start);
+    spanEnd("build", start);
+    if (textCodec != TEXT_PLAIN) {
+      indexFree(oldText);    // the index has the text, compressed
+      oldText = NULL;
+    }
+  } else if (backend == BACKEND_FM) {
+    fprintf(stderr,"Building FM-index...");
+    start = nowUs();
+    buildFM(oldText, oldTextLength);
+    statPhase(PHASE_BUILD, start);
+    spanEnd("build", start);
+  } else if (backend == BACKEND_SA) {
+    fprintf(stderr,"Building suffix array...");
+    start = nowUs();
+    buildSA(oldText, oldTextLength);
+    statPhase(PHASE_BUILD, start);
+    spanEnd("build", start);
+  }
+  } // end fetch
+
+  if (base != NULL) {
+    if (numaPolicy == NUMA_REPLICATE && numaNodes > 1) {
+      queryNode = currentNode();
+      replicateStatic(base);
+      pinToNode(queryNode);
+    }
+
+    // the first version with the static index: queries start from here
+    pthread_mutex_lock(&writerLock);
+    IndexVersion *v = copyVersion(atomic_load(&current));
+    base->refs = 1;
+    v->base = base;
+    if (indexIn != NULL) {
+      loadTombstones(v, indexIn);
+      if (newTombs) saveTombstones(v, indexIn);
+    }
+    publishVersion(v);
+    pthread_mutex_unlock(&writerLock);
+  }
+  if (mapped) {
+    // -f with a mapped index: the file has grown since the index was built
+    if (fileGiven) appendFromFile(oldFileName);
+    if (compact && atomic_load(&current)->ndeltas > 0) startCompaction(indexIn);
+    fprintf(stderr,"\n");
+  }
+  reportPlacement();
+
 
+
+  // ************ QUERY
+  if (queryLen > 0) {
+    fprintf(stderr,"\n\n ***** QUERY *****\n\n");
+    PosType *r;
+    int truncated, rSize = answerQuery(queryStr, queryLen, &r, 1, &truncated);
+
+    // Results available in r[] and their are rSize
+    double start = nowUs();
+    for(int j=0; j < rSize; j++)
+      fprintf(stderr,"%ld\n",r[j]);
+    statPhase(PHASE_OUTPUT, start);
+    if (truncated) fprintf(stderr, "  truncated: the bounds of -D or -L stopped the query\n");
+    arenaReset(&scratch);
+  }
+
+  if (serving) serve(nthreads, indexIn, socketName);
+  if (statsFile != NULL) dumpStats();
+  if (explainFile != NULL && explainFile != stderr) fclose(explainFile);
+  if (timelineFile != NULL) {
+    finishCompaction();      // it records spans too
+    timelineWrite();
+  }
+
+  arenaFree(&scratch);
+  textCacheFree();
+  if (resultBudget > 0) destroyResultCache();
+  destroyIndex(!mapped);
+  free(queryStr);
+  return 0;
+}